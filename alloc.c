@@ -0,0 +1,156 @@
+#include "alloc.h"
+#include "fat.h"
+#include "fat16.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#define WORD_BITS 64
+
+static uint64_t *free_map;      // 1 表示空闲
+static uint32_t map_words;
+static uint32_t cluster_limit;  // 可用簇号上界（不含）
+static uint32_t free_count;
+
+static int is_free(uint32_t c) {
+    return (free_map[c / WORD_BITS] >> (c % WORD_BITS)) & 1;
+}
+
+static void set_free(uint32_t c, int free) {
+    if (free)
+        free_map[c / WORD_BITS] |= (uint64_t)1 << (c % WORD_BITS);
+    else
+        free_map[c / WORD_BITS] &= ~((uint64_t)1 << (c % WORD_BITS));
+}
+
+int alloc_init() {
+    // 数据区实际能容纳的簇数，FAT 表可能比它大
+    uint32_t sectors = boot_record.bpb.small_sector ?
+        boot_record.bpb.small_sector : boot_record.bpb.large_sector;
+    long size_image = (long)sectors * boot_record.bpb.bytes_per_sector;
+    long data_clusters = size_image > offset_data ? (size_image - offset_data) / size_cluster : 0;
+
+    cluster_limit = data_clusters + CLUSTER_MIN;
+    if (cluster_limit > fat_entries())
+        cluster_limit = fat_entries();
+    if (cluster_limit > CLUSTER_MAX + 1)
+        cluster_limit = CLUSTER_MAX + 1;
+
+    map_words = (cluster_limit + WORD_BITS - 1) / WORD_BITS;
+    free_map = calloc(map_words, sizeof(uint64_t));
+    if (!free_map)
+        return -ENOMEM;
+
+    free_count = 0;
+    for (uint32_t c = CLUSTER_MIN; c < cluster_limit; c++) {
+        if (fat_get(c) == CLUSTER_FREE) {
+            set_free(c, 1);
+            free_count++;
+        }
+    }
+
+    return 0;
+}
+
+// 从 from 开始找第一个空闲簇，找不到返回 cluster_limit
+static uint32_t find_free(uint32_t from) {
+    uint32_t w = from / WORD_BITS;
+    if (w >= map_words)
+        return cluster_limit;
+
+    // 屏蔽 from 之前的位
+    uint64_t bits = free_map[w] & (~(uint64_t)0 << (from % WORD_BITS));
+    while (!bits) {
+        if (++w >= map_words)
+            return cluster_limit;
+        bits = free_map[w];
+    }
+
+    uint32_t c = w * WORD_BITS + __builtin_ctzll(bits);
+    return c < cluster_limit ? c : cluster_limit;
+}
+
+// 从空闲簇 c 开始连续空闲簇的数量，按字统计
+static uint32_t run_length(uint32_t c) {
+    uint32_t n = 0;
+    while (c + n < cluster_limit) {
+        uint32_t bit = (c + n) % WORD_BITS;
+        uint64_t used = ~free_map[(c + n) / WORD_BITS] >> bit;  // 1 表示已占用
+        if (used) {
+            n += __builtin_ctzll(used);
+            break;
+        }
+        n += WORD_BITS - bit;
+    }
+    return c + n < cluster_limit ? n : cluster_limit - c;
+}
+
+// 最佳适配：长度不小于 want 的最短空闲段，没有时取最长的一段
+// 返回起始簇号，len 返回该段长度
+static uint32_t best_fit(uint32_t want, uint32_t *len) {
+    uint32_t best = cluster_limit;
+    uint32_t best_len = 0;
+
+    for (uint32_t c = find_free(CLUSTER_MIN); c < cluster_limit; ) {
+        uint32_t n = run_length(c);
+        int better = n >= want ? (best_len < want || n < best_len)
+                               : (best_len < want && n > best_len);
+        if (better) {
+            best = c;
+            best_len = n;
+            if (n == want)  // 恰好合适
+                break;
+        }
+        c = find_free(c + n);
+    }
+
+    *len = best_len;
+    return best;
+}
+
+uint32_t alloc_run(uint32_t max, uint16_t goal, uint16_t *start) {
+    if (!free_map || max == 0 || free_count == 0)
+        return 0;
+
+    // 优先紧接在文件末尾之后分配
+    uint32_t c, n;
+    if (goal >= CLUSTER_MIN && goal < cluster_limit && is_free(goal)) {
+        c = goal;
+        n = run_length(goal);
+    } else {
+        c = best_fit(max, &n);
+    }
+    if (n == 0)
+        return 0;
+    if (n > max)
+        n = max;
+
+    for (uint32_t i = 0; i < n; i++)
+        set_free(c + i, 0);
+
+    free_count -= n;
+    *start = c;
+    return n;
+}
+
+void alloc_free(uint16_t cluster) {
+    if (!free_map || cluster < CLUSTER_MIN || cluster >= cluster_limit || is_free(cluster))
+        return;
+
+    set_free(cluster, 1);
+    free_count++;
+}
+
+uint32_t alloc_free_count() {
+    return free_count;
+}
+
+uint32_t alloc_cluster_limit() {
+    return cluster_limit;
+}
+
+void alloc_release() {
+    free(free_map);
+    free_map = NULL;
+    free_count = 0;
+}
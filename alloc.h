@@ -0,0 +1,32 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+
+// 空闲簇分配器
+// 挂载时根据 FAT 表建立空闲位图，之后的分配与释放都只修改位图，
+// FAT 表项由调用者负责链接
+// 分配器与 FAT 表共用一把锁，分配与释放时调用者需持有 FAT 写锁
+
+// 根据内存中的 FAT 表建立空闲位图
+// 0:成功 负数:失败
+int alloc_init();
+
+// 分配一段连续空闲簇，最多 max 个，start 返回起始簇号
+// goal 空闲时从 goal 开始（紧接文件末尾），否则选择长度不小于 max 的最短空闲段，
+// 都不够长时选择最长的一段，使多次分配得到的段数最少
+// 返回分配的簇数量，0 表示没有空闲簇
+uint32_t alloc_run(uint32_t max, uint16_t goal, uint16_t *start);
+
+// 将簇标记为空闲
+void alloc_free(uint16_t cluster);
+
+// 当前空闲簇数量
+uint32_t alloc_free_count();
+
+// 数据区可用的簇号上界（不含）
+uint32_t alloc_cluster_limit();
+
+void alloc_release();
+
+#endif
@@ -0,0 +1,636 @@
+#include "cache.h"
+#include "fat16.h"
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// 超过这个簇数的读写直接访问 image，避免大文件冲刷缓存
+#define CACHE_BYPASS_CLUSTERS 16
+#define CACHE_BATCH 64          // cache_batch 每次提交给 io_batch 的最大请求数
+
+struct Buffer {
+    long pos;                   // 块在 image 的偏移
+    size_t len;                 // 块长度，根目录区最后一块可能不足一簇
+    int dirty;
+    int loading;                // 正在从 image 读入，其他线程需等待
+    int writing;                // 已交给日志提交，写回 image 之前不能淘汰
+    int meta;                   // 元数据块（根目录区与写过目录项的簇），日志模式下只由日志提交写回
+    char *data;
+    struct Buffer *hash_next;   // 哈希链
+    struct Buffer *prev;        // LRU 链表，表头为最近使用
+    struct Buffer *next;
+};
+
+// 正在绕过缓存读写的范围，其中的脏块在读写完成前不能淘汰，
+// 否则淘汰时写回的旧内容会覆盖绕过的写，或被绕过的读读到
+struct Pin {
+    long offset;
+    size_t size;
+    struct Pin *next;
+};
+
+static struct Buffer **buckets;
+static size_t bucket_count;     // 2 的幂
+static size_t max_buffers;
+static size_t nr_buffers;
+static struct Buffer lru = { .prev = &lru, .next = &lru };  // 哨兵
+static int no_steal;            // 淘汰时跳过脏的元数据块
+static struct Pin *pins;        // 正在进行的绕过读写
+
+// 保护哈希表、LRU 与块内容；读入块时不持有锁，完成后唤醒等待者
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+
+// 计算 offset 所在块的起点与长度
+// 返回 0 表示该位置不缓存
+static int block_of(long offset, long *start, size_t *len) {
+    if (offset < offset_root)
+        return 0;
+
+    if (offset < offset_data) {
+        *start = offset_root + (offset - offset_root) / size_cluster * size_cluster;
+        *len = offset_data - *start < (long)size_cluster ? (size_t)(offset_data - *start) : size_cluster;
+    } else {
+        *start = offset_data + (offset - offset_data) / size_cluster * size_cluster;
+        *len = size_cluster;
+    }
+    return 1;
+}
+
+static struct Buffer **bucket(long pos) {
+    return &buckets[(size_t)(pos / size_cluster) & (bucket_count - 1)];
+}
+
+static void lru_unlink(struct Buffer *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void lru_push(struct Buffer *b) {
+    b->next = lru.next;
+    b->prev = &lru;
+    lru.next->prev = b;
+    lru.next = b;
+}
+
+static struct Buffer *find(long pos) {
+    for (struct Buffer *b = *bucket(pos); b; b = b->hash_next) {
+        if (b->pos == pos)
+            return b;
+    }
+    return NULL;
+}
+
+// 块位于某个绕过读写的范围内
+static int is_pinned(const struct Buffer *b) {
+    for (struct Pin *p = pins; p; p = p->next) {
+        if (b->pos < p->offset + (long)p->size && p->offset < b->pos + (long)b->len)
+            return 1;
+    }
+    return 0;
+}
+
+// 绕过缓存读写之前登记范围
+static void pin_range(struct Pin *pin, long offset, size_t size) {
+    pin->offset = offset;
+    pin->size = size;
+    pthread_mutex_lock(&cache_lock);
+    pin->next = pins;
+    pins = pin;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// 调用者持有 cache_lock
+static void unpin_range(struct Pin *pin) {
+    struct Pin **p = &pins;
+    while (*p != pin)
+        p = &(*p)->next;
+    *p = pin->next;
+}
+
+static int write_back(struct Buffer *b) {
+    if (b->dirty) {
+        if (b->len != io_write(b->data, b->pos, b->len))
+            return -EIO;
+        b->dirty = 0;
+    }
+    return 0;
+}
+
+static void drop(struct Buffer *b) {
+    struct Buffer **p = bucket(b->pos);
+    while (*p != b)
+        p = &(*p)->hash_next;
+    *p = b->hash_next;
+
+    lru_unlink(b);
+    free(b->data);
+    free(b);
+    nr_buffers--;
+}
+
+// 分配新块并加入哈希表，必要时淘汰一块
+// 调用者持有 cache_lock
+static struct Buffer *new_buffer(long pos, size_t len, int loading) {
+    // 淘汰最久未使用的块，跳过正在读入的块
+    if (nr_buffers >= max_buffers) {
+        struct Buffer *victim = lru.prev;
+        while (victim != &lru && (victim->loading || victim->writing
+                                  || (victim->dirty && ((no_steal && victim->meta) || is_pinned(victim)))))
+            victim = victim->prev;
+        if (victim != &lru) {
+            if (write_back(victim) < 0)
+                return NULL;
+            drop(victim);
+        }
+    }
+
+    struct Buffer *b = calloc(1, sizeof(struct Buffer));
+    if (!b)
+        return NULL;
+    b->data = malloc(len);
+    if (!b->data) {
+        free(b);
+        return NULL;
+    }
+
+    b->pos = pos;
+    b->len = len;
+    b->loading = loading;
+    b->meta = pos < offset_data;
+
+    struct Buffer **p = bucket(pos);
+    b->hash_next = *p;
+    *p = b;
+    lru_push(b);
+    nr_buffers++;
+    return b;
+}
+
+// 取得块，不存在时分配，fill 为 1 时从 image 读入内容
+// 调用者持有 cache_lock，读入期间会暂时释放
+static struct Buffer *get_buffer(long pos, size_t len, int fill) {
+    struct Buffer *b;
+    while ((b = find(pos)) && b->loading)
+        pthread_cond_wait(&loaded, &cache_lock);
+
+    if (b) {    // 移到 LRU 表头
+        lru_unlink(b);
+        lru_push(b);
+        return b;
+    }
+
+    if (!(b = new_buffer(pos, len, fill)))
+        return NULL;
+
+    if (fill) {
+        pthread_mutex_unlock(&cache_lock);
+        size_t n = io_read(b->data, pos, len);
+        pthread_mutex_lock(&cache_lock);
+
+        b->loading = 0;
+        pthread_cond_broadcast(&loaded);
+        if (n != len) {
+            drop(b);
+            return NULL;
+        }
+    }
+    return b;
+}
+
+int cache_init(size_t budget) {
+    max_buffers = budget / size_cluster;
+    if (max_buffers == 0)
+        return 0;
+
+    bucket_count = 1;
+    while (bucket_count < max_buffers)
+        bucket_count <<= 1;
+
+    buckets = calloc(bucket_count, sizeof(struct Buffer *));
+    if (!buckets) {
+        max_buffers = 0;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// 范围内的块都已缓存（或正在读入）
+// 调用者持有 cache_lock
+static int is_cached(long offset, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        long start;
+        size_t len;
+        if (!block_of(offset + done, &start, &len) || !find(start))
+            return 0;
+        done += start + len - (offset + done);
+    }
+    return 1;
+}
+
+// 大块读写绕过缓存，避免大文件冲刷缓存；预读已载入缓存的大块读仍从缓存读取
+static int is_bypass(int write, long offset, size_t size) {
+    if (size < CACHE_BYPASS_CLUSTERS * size_cluster)
+        return 0;
+    if (write)
+        return 1;
+
+    pthread_mutex_lock(&cache_lock);
+    int cached = is_cached(offset, size);
+    pthread_mutex_unlock(&cache_lock);
+    return !cached;
+}
+
+// 绕过缓存的读写后，与范围内已缓存的块同步，并解除 pin 登记的范围
+// to_cache 为 1 时用 buf 更新缓存，否则用缓存（可能更新）覆盖 buf
+// 调用者持有 cache_lock
+static void sync_cached(struct Pin *pin, void *buf, long offset, size_t size, int to_cache) {
+    unpin_range(pin);
+
+    size_t done = 0;
+    while (done < size) {
+        long start;
+        size_t len;
+        long pos = offset + done;
+        if (!block_of(pos, &start, &len))
+            return;
+
+        size_t in_block = pos - start;
+        size_t n = len - in_block;
+        if (n > size - done)
+            n = size - done;
+
+        // 正在读入的块内容未定，写入时等它完成再覆盖
+        struct Buffer *b;
+        while ((b = find(start)) && b->loading)
+            pthread_cond_wait(&loaded, &cache_lock);
+
+        if (b && to_cache) {
+            // 写回可能在绕过的写之前发生，保持为脏块以免旧内容留在 image
+            memcpy(b->data + in_block, buf + done, n);
+            b->dirty = 1;
+        } else if (b) {
+            memcpy(buf + done, b->data + in_block, n);
+        }
+
+        done += n;
+    }
+}
+
+size_t cache_read(void *buf, long offset, size_t size) {
+    if (!buckets)
+        return io_read(buf, offset, size);
+
+    if (is_bypass(0, offset, size)) {
+        struct Pin pin;
+        pin_range(&pin, offset, size);
+        size_t n = io_read(buf, offset, size);
+        pthread_mutex_lock(&cache_lock);
+        sync_cached(&pin, buf, offset, n, 0);
+        pthread_mutex_unlock(&cache_lock);
+        return n;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    size_t done = 0;
+    while (done < size) {
+        long start;
+        size_t len;
+        long pos = offset + done;
+        if (!block_of(pos, &start, &len)) { // 不缓存的区域
+            pthread_mutex_unlock(&cache_lock);
+            return done + io_read(buf + done, pos, size - done);
+        }
+
+        size_t in_block = pos - start;
+        size_t n = len - in_block;
+        if (n > size - done)
+            n = size - done;
+
+        struct Buffer *b = get_buffer(start, len, 1);
+        if (!b)
+            break;
+        memcpy(buf + done, b->data + in_block, n);
+
+        done += n;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return done;
+}
+
+// meta 为 1 时写入的块标记为元数据块，之后一直保持
+static size_t write_blocks(const void *buf, long offset, size_t size, int meta) {
+    if (!buckets)
+        return io_write(buf, offset, size);
+
+    if (is_bypass(1, offset, size)) {
+        struct Pin pin;
+        pin_range(&pin, offset, size);
+        size_t n = io_write(buf, offset, size);
+        pthread_mutex_lock(&cache_lock);
+        sync_cached(&pin, (void *)buf, offset, n, 1);     // to_cache 为 1 时只读取 buf
+        pthread_mutex_unlock(&cache_lock);
+        return n;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    size_t done = 0;
+    while (done < size) {
+        long start;
+        size_t len;
+        long pos = offset + done;
+        if (!block_of(pos, &start, &len)) {
+            pthread_mutex_unlock(&cache_lock);
+            return done + io_write(buf + done, pos, size - done);
+        }
+
+        size_t in_block = pos - start;
+        size_t n = len - in_block;
+        if (n > size - done)
+            n = size - done;
+
+        // 整块覆盖时不必先读入
+        struct Buffer *b = get_buffer(start, len, n != len);
+        if (!b)
+            break;
+        memcpy(b->data + in_block, buf + done, n);
+        b->dirty = 1;
+        b->meta |= meta;
+
+        done += n;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return done;
+}
+
+size_t cache_write(const void *buf, long offset, size_t size) {
+    return write_blocks(buf, offset, size, 0);
+}
+
+size_t cache_write_meta(const void *buf, long offset, size_t size) {
+    return write_blocks(buf, offset, size, 1);
+}
+
+// 一组不超过 CACHE_BATCH 的请求
+static int batch(int write, struct IoRequest *reqs, int count) {
+    struct IoRequest direct[CACHE_BATCH];
+    struct Pin pin[CACHE_BATCH];
+    int slot[CACHE_BATCH];      // direct 中的请求在 reqs 中的位置
+    int nr_direct = 0;
+    int ret = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct IoRequest *r = &reqs[i];
+        if (is_bypass(write, r->offset, r->size)) {
+            pin_range(&pin[nr_direct], r->offset, r->size);
+            slot[nr_direct] = i;
+            direct[nr_direct++] = *r;
+            continue;
+        }
+
+        r->done = write ? cache_write(r->buf, r->offset, r->size)
+                        : cache_read(r->buf, r->offset, r->size);
+        if (r->done != r->size)
+            ret = -EIO;
+    }
+
+    if (nr_direct == 0)
+        return ret;
+
+    if (io_batch(write, direct, nr_direct) < 0)
+        ret = -EIO;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < nr_direct; i++) {
+        sync_cached(&pin[i], direct[i].buf, direct[i].offset, direct[i].done, write);
+        reqs[slot[i]].done = direct[i].done;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+int cache_batch(int write, struct IoRequest *reqs, int count) {
+    if (!buckets)
+        return io_batch(write, reqs, count);
+
+    int ret = 0;
+    for (int i = 0; i < count; i += CACHE_BATCH) {
+        int n = count - i < CACHE_BATCH ? count - i : CACHE_BATCH;
+        if (batch(write, reqs + i, n) < 0)
+            ret = -EIO;
+    }
+    return ret;
+}
+
+size_t cache_capacity() {
+    return buckets ? max_buffers * size_cluster : 0;
+}
+
+// 读入一段连续的缺失块
+// 调用者持有 cache_lock，读入期间会暂时释放
+static void prefetch_run(struct Buffer **run, int count) {
+    struct iovec iov[CACHE_BATCH];
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = run[i]->data;
+        iov[i].iov_len = run[i]->len;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    size_t n = io_readv(iov, count, run[0]->pos);
+    pthread_mutex_lock(&cache_lock);
+
+    for (int i = 0; i < count; i++) {
+        run[i]->loading = 0;
+        if (n < (size_t)(run[i]->pos - run[0]->pos) + run[i]->len)   // 未读完整
+            drop(run[i]);
+    }
+    pthread_cond_broadcast(&loaded);
+}
+
+void cache_prefetch(long offset, size_t size) {
+    if (!buckets)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    struct Buffer *run[CACHE_BATCH];
+    int count = 0;
+    size_t done = 0;
+    while (done < size) {
+        long start;
+        size_t len;
+        if (!block_of(offset + done, &start, &len))
+            break;
+        done += start + len - (offset + done);
+
+        // 已缓存的块打断连续的一段，读入期间锁被释放，之后重新查找
+        if (count > 0 && (find(start) || count == CACHE_BATCH)) {
+            prefetch_run(run, count);
+            count = 0;
+        }
+        if (find(start))
+            continue;
+
+        struct Buffer *b = new_buffer(start, len, 1);
+        if (!b)
+            break;
+        run[count++] = b;
+    }
+
+    if (count > 0)
+        prefetch_run(run, count);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_is_clean(long offset, size_t size) {
+    if (!buckets)
+        return 1;
+
+    int clean = 1;
+    pthread_mutex_lock(&cache_lock);
+    size_t done = 0;
+    while (clean && done < size) {
+        long start;
+        size_t len;
+        if (!block_of(offset + done, &start, &len))
+            break;
+
+        struct Buffer *b = find(start);
+        if (b && (b->dirty || b->writing))
+            clean = 0;
+        done += start + len - (offset + done);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return clean;
+}
+
+static int compare_pos(const void *a, const void *b) {
+    long pa = (*(struct Buffer * const *)a)->pos;
+    long pb = (*(struct Buffer * const *)b)->pos;
+    return pa < pb ? -1 : pa > pb;
+}
+
+// data_only 为 1 时只写回数据块，元数据块留给日志提交
+static int flush(int data_only) {
+    if (!buckets)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct Buffer **dirty = malloc((nr_buffers + 1) * sizeof(struct Buffer *));
+    if (!dirty) {
+        pthread_mutex_unlock(&cache_lock);
+        return -ENOMEM;
+    }
+
+    size_t count = 0;
+    for (struct Buffer *b = lru.next; b != &lru; b = b->next) {
+        if (b->dirty && !(data_only && b->meta))
+            dirty[count++] = b;
+    }
+
+    // 按偏移排序，相邻的块合并为一次写
+    qsort(dirty, count, sizeof(struct Buffer *), compare_pos);
+
+    int ret = 0;
+    size_t i = 0;
+    while (i < count) {
+        struct iovec iov[64];
+        int n = 0;
+        size_t total = 0;
+        long pos = dirty[i]->pos;
+        while (i + n < count && n < 64 && dirty[i + n]->pos == pos + (long)total) {
+            iov[n].iov_base = dirty[i + n]->data;
+            iov[n].iov_len = dirty[i + n]->len;
+            total += dirty[i + n]->len;
+            n++;
+        }
+
+        if (total != io_writev(iov, n, pos)) {
+            ret = -EIO;
+            break;
+        }
+
+        for (int k = 0; k < n; k++)
+            dirty[i + k]->dirty = 0;
+        i += n;
+    }
+
+    free(dirty);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+int cache_flush() {
+    return flush(0);
+}
+
+int cache_flush_data() {
+    return flush(1);
+}
+
+void cache_set_no_steal(int value) {
+    pthread_mutex_lock(&cache_lock);
+    no_steal = value;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_over_budget() {
+    pthread_mutex_lock(&cache_lock);
+    int over = buckets && nr_buffers > max_buffers;
+    pthread_mutex_unlock(&cache_lock);
+    return over;
+}
+
+int cache_collect(int (*emit)(void *ctx, long pos, const void *data, size_t len), void *ctx) {
+    if (!buckets)
+        return 0;
+
+    // 先交出所有脏的元数据块，全部成功后才标记，失败时不改变任何块的状态
+    int ret = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (struct Buffer *b = lru.next; b != &lru; b = b->next) {
+        if (b->dirty && b->meta && (ret = emit(ctx, b->pos, b->data, b->len)) < 0)
+            break;
+    }
+
+    for (struct Buffer *b = lru.next; ret == 0 && b != &lru; b = b->next) {
+        if (b->dirty && b->meta) {
+            b->dirty = 0;
+            b->writing = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+void cache_collect_done(int written) {
+    if (!buckets)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (struct Buffer *b = lru.next; b != &lru; b = b->next) {
+        if (b->writing && !written)
+            b->dirty = 1;
+        b->writing = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_release() {
+    if (!buckets)
+        return;
+
+    cache_flush();
+    while (lru.next != &lru)
+        drop(lru.next);
+
+    free(buckets);
+    buckets = NULL;
+    nr_buffers = 0;
+}
@@ -0,0 +1,66 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include "io.h"
+
+// 簇粒度的缓冲区缓存（哈希 + LRU），写回式
+// 覆盖根目录区和数据区，其余区域直接访问 image
+// 接口与 io_read/io_write 相同
+
+// budget 为可用内存字节数，0 表示不缓存
+// 0:成功 负数:失败
+int cache_init(size_t budget);
+
+// 读取，命中的块直接从内存复制
+// 返回读取的长度
+size_t cache_read(void *buf, long offset, size_t size);
+
+// 写入，只修改缓存中的块并标记为脏
+// 返回写入的长度
+size_t cache_write(const void *buf, long offset, size_t size);
+
+// 写入目录项或目录簇，与 cache_write 相同，但块被标记为元数据块，日志模式下只由日志提交写回
+// 根目录区的块总是元数据块
+size_t cache_write_meta(const void *buf, long offset, size_t size);
+
+// 批量读写互不重叠的多个范围，大块读写经 io_batch 一次提交，其余经过缓存
+// 0:全部完成 -EIO:有请求未完成
+int cache_batch(int write, struct IoRequest *reqs, int count);
+
+// 缓存的总容量（字节），未启用缓存时为 0
+size_t cache_capacity();
+
+// 预读，将范围内尚未缓存的块读入缓存，连续的缺失块合并为一次读
+void cache_prefetch(long offset, size_t size);
+
+// 范围内没有尚未写回 image 的块（脏块或正在由日志提交的块），image 中的内容是最新的
+int cache_is_clean(long offset, size_t size);
+
+// 将所有脏块写回 image
+// 0:成功 负数:失败
+int cache_flush();
+
+// 只写回脏的数据块，日志提交前调用，使数据先于引用它的元数据写入 image
+// 0:成功 负数:失败
+int cache_flush_data();
+
+// 不淘汰脏的元数据块（日志模式），它们只能由日志提交写回；脏的数据块照常写回后淘汰
+// 缓存中全是脏的元数据块时允许暂时超出预算
+void cache_set_no_steal(int no_steal);
+
+// 脏块过多，超出了预算
+int cache_over_budget();
+
+// 日志提交时取出所有脏的元数据块交给 emit，之后标记为干净，不写回 image
+// 0:成功 负数:emit 失败，所有块保持原样
+// 取出的块在 cache_collect_done 之前不会被淘汰，避免读到 image 中的旧内容
+int cache_collect(int (*emit)(void *ctx, long pos, const void *data, size_t len), void *ctx);
+
+// 结束一次提交，written 为 1 时取出的块已写回 image；否则恢复为脏，由下次提交重新取出
+void cache_collect_done(int written);
+
+// 写回并释放所有缓存
+void cache_release();
+
+#endif
@@ -0,0 +1,208 @@
+#include "dcache.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define DCACHE_BUCKETS 4096
+#define DCACHE_MAX 16384        // 最多缓存的目录项数
+
+struct Dentry {
+    uint16_t parent;
+    char name[MAX_FULLNAME];    // 大写的文件名
+    int negative;
+    long offset;                // FCB 在 image 的偏移，负项为 -1
+    struct FCB fcb;
+    struct Dentry *name_next;   // 按名字的哈希链
+    struct Dentry *offset_next; // 按偏移的哈希链，只包含正项
+    struct Dentry *prev;        // LRU 链表
+    struct Dentry *next;
+};
+
+static struct Dentry *by_name[DCACHE_BUCKETS];
+static struct Dentry *by_offset[DCACHE_BUCKETS];
+static struct Dentry lru = { .prev = &lru, .next = &lru };
+static size_t nr_dentries;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long generation;    // 受 dcache_lock 保护
+
+// 转为大写，超出 8.3 长度的名字不缓存
+static int normalize(const char *name, char *out) {
+    size_t len = strlen(name);
+    if (len >= MAX_FULLNAME)
+        return 0;
+
+    for (size_t i = 0; i <= len; i++)
+        out[i] = toupper((unsigned char)name[i]);
+    return 1;
+}
+
+static size_t hash_name(uint16_t parent, const char *name) {
+    size_t h = parent * 31u;
+    while (*name)
+        h = h * 131 + (unsigned char)*name++;
+    return h % DCACHE_BUCKETS;
+}
+
+static size_t hash_offset(long offset) {
+    return (size_t)(offset / sizeof(struct FCB)) % DCACHE_BUCKETS;
+}
+
+static struct Dentry *find(uint16_t parent, const char *name) {
+    for (struct Dentry *d = by_name[hash_name(parent, name)]; d; d = d->name_next) {
+        if (d->parent == parent && !strcmp(d->name, name))
+            return d;
+    }
+    return NULL;
+}
+
+static void unlink_chain(struct Dentry **p, struct Dentry *d, int offset_chain) {
+    while (*p && *p != d)
+        p = offset_chain ? &(*p)->offset_next : &(*p)->name_next;
+    if (*p)
+        *p = offset_chain ? d->offset_next : d->name_next;
+}
+
+static void drop(struct Dentry *d) {
+    unlink_chain(&by_name[hash_name(d->parent, d->name)], d, 0);
+    if (!d->negative)
+        unlink_chain(&by_offset[hash_offset(d->offset)], d, 1);
+
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+    free(d);
+    nr_dentries--;
+}
+
+int dcache_lookup(uint16_t parent, const char *name, struct FCB *fcb, long *offset) {
+    char key[MAX_FULLNAME];
+    if (!normalize(name, key))
+        return -1;
+
+    pthread_mutex_lock(&dcache_lock);
+    struct Dentry *d = find(parent, key);
+    if (!d) {
+        pthread_mutex_unlock(&dcache_lock);
+        return -1;
+    }
+
+    // 移到 LRU 表头
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+    d->next = lru.next;
+    d->prev = &lru;
+    lru.next->prev = d;
+    lru.next = d;
+
+    int ret = 0;
+    if (!d->negative) {
+        memcpy(fcb, &d->fcb, sizeof(struct FCB));
+        *offset = d->offset;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return ret;
+}
+
+unsigned long dcache_generation() {
+    pthread_mutex_lock(&dcache_lock);
+    unsigned long g = generation;
+    pthread_mutex_unlock(&dcache_lock);
+    return g;
+}
+
+void dcache_add(uint16_t parent, const char *name, const struct FCB *fcb, long offset, unsigned long gen) {
+    char key[MAX_FULLNAME];
+    if (!normalize(name, key))
+        return;
+
+    pthread_mutex_lock(&dcache_lock);
+    if (gen != generation) {    // 读取目录之后有目录项被修改
+        pthread_mutex_unlock(&dcache_lock);
+        return;
+    }
+
+    struct Dentry *d = find(parent, key);
+    if (d)
+        drop(d);
+
+    if (nr_dentries >= DCACHE_MAX)
+        drop(lru.prev);
+
+    if (!(d = calloc(1, sizeof(struct Dentry)))) {
+        pthread_mutex_unlock(&dcache_lock);
+        return;
+    }
+
+    d->parent = parent;
+    strcpy(d->name, key);
+    d->negative = fcb == NULL;
+    d->offset = fcb ? offset : -1;
+    if (fcb)
+        memcpy(&d->fcb, fcb, sizeof(struct FCB));
+
+    size_t h = hash_name(parent, key);
+    d->name_next = by_name[h];
+    by_name[h] = d;
+    if (fcb) {
+        h = hash_offset(offset);
+        d->offset_next = by_offset[h];
+        by_offset[h] = d;
+    }
+
+    d->next = lru.next;
+    d->prev = &lru;
+    lru.next->prev = d;
+    lru.next = d;
+    nr_dentries++;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_remove(uint16_t parent, const char *name) {
+    char key[MAX_FULLNAME];
+    if (!normalize(name, key))
+        return;
+
+    pthread_mutex_lock(&dcache_lock);
+    generation++;
+    struct Dentry *d = find(parent, key);
+    if (d)
+        drop(d);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_update(long offset, const struct FCB *fcb) {
+    pthread_mutex_lock(&dcache_lock);
+    generation++;
+    struct Dentry *d = by_offset[hash_offset(offset)];
+    while (d && d->offset != offset)
+        d = d->offset_next;
+
+    if (d && (is_entry_end(fcb) || !is_entry_exists(fcb)))   // 已删除
+        drop(d);
+    else if (d)
+        memcpy(&d->fcb, fcb, sizeof(struct FCB));
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_purge_dir(uint16_t parent) {
+    pthread_mutex_lock(&dcache_lock);
+    generation++;
+    struct Dentry *d = lru.next;
+    while (d != &lru) {
+        struct Dentry *next = d->next;
+        if (d->parent == parent)
+            drop(d);
+        d = next;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_release() {
+    pthread_mutex_lock(&dcache_lock);
+    while (lru.next != &lru)
+        drop(lru.next);
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "fat16.h"
+
+// 目录项缓存，以（父目录起始簇，文件名）为键缓存 FCB 及其在 image 的偏移
+// 也缓存不存在的文件（负项）
+// 根目录的键为 0；空目录的起始簇为 CLUSTER_END，其下只会有负项
+
+#define DCACHE_ROOT 0
+
+// 查找
+// 返回 1 命中并填充 fcb 和 offset，0 表示文件不存在（负项），-1 未命中
+int dcache_lookup(uint16_t parent, const char *name, struct FCB *fcb, long *offset);
+
+// 缓存项被修改或移除的次数
+// 查找目录前取得，加入缓存时传入；期间若有修改则放弃加入，避免并发的查找放回旧的内容
+unsigned long dcache_generation();
+
+// 加入缓存，fcb 为 NULL 时加入负项
+void dcache_add(uint16_t parent, const char *name, const struct FCB *fcb, long offset, unsigned long generation);
+
+// 目录中新增了该名字的文件，删除对应的缓存项
+void dcache_remove(uint16_t parent, const char *name);
+
+// offset 处的 FCB 被改写，更新对应的缓存项；FCB 被删除时移除
+void dcache_update(long offset, const struct FCB *fcb);
+
+// 目录被删除，移除其下的所有缓存项
+void dcache_purge_dir(uint16_t parent);
+
+void dcache_release();
+
+#endif
@@ -0,0 +1,368 @@
+#include "dirindex.h"
+#include "dcache.h"
+#include "utils.h"
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define NAME_LEN (MAX_FILENAME + MAX_EXTNAME)
+#define MAX_INDEXED_DIRS 64         // 最多同时索引的目录数
+#define OFFSET_BUCKETS 4096
+
+struct IndexEntry {
+    char name[NAME_LEN];            // 大写，空格填充
+    long offset;                    // FCB 在 image 的偏移
+    struct DirIndex *owner;
+    struct IndexEntry *name_next;   // 目录内按名字的哈希链
+    struct IndexEntry *offset_next; // 全局按偏移的哈希链
+};
+
+struct DirIndex {
+    uint16_t key;
+    struct IndexEntry **buckets;
+    size_t bucket_count;            // 2 的幂
+    size_t count;
+    int failed;                     // 建立索引时内存不足
+    int linked;                     // 已发布，表项在全局按偏移的哈希链中
+    struct DirIndex *prev;          // LRU 链表
+    struct DirIndex *next;
+};
+
+static struct DirIndex lru = { .prev = &lru, .next = &lru };
+static size_t nr_indexes;
+static struct IndexEntry *by_offset[OFFSET_BUCKETS];
+
+// 扫描目录建立索引时不持有该锁，建立完成后在锁内发布
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static int building;                // 正在建立的索引数
+static unsigned long changes;       // 有索引正在建立时，可能没有被扫描到的修改次数
+
+// 将路径中的文件名转为 FCB 中的 11 字节形式
+// 超出 8.3 长度返回 0
+static int to_fcb_name(const char *name, char *out) {
+    const char *dot = strrchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base == 0 || base > MAX_FILENAME || ext > MAX_EXTNAME)
+        return 0;
+
+    memset(out, ' ', NAME_LEN);
+    for (size_t i = 0; i < base; i++)
+        out[i] = toupper((unsigned char)name[i]);
+    for (size_t i = 0; i < ext; i++)
+        out[MAX_FILENAME + i] = toupper((unsigned char)dot[1 + i]);
+    return 1;
+}
+
+static void fcb_name(const struct FCB *fcb, char *out) {
+    for (size_t i = 0; i < MAX_FILENAME; i++)
+        out[i] = toupper((unsigned char)fcb->filename[i]);
+    for (size_t i = 0; i < MAX_EXTNAME; i++)
+        out[MAX_FILENAME + i] = toupper((unsigned char)fcb->extname[i]);
+}
+
+static size_t hash_name(const char *name) {
+    size_t h = 0;
+    for (size_t i = 0; i < NAME_LEN; i++)
+        h = h * 131 + (unsigned char)name[i];
+    return h;
+}
+
+static size_t hash_offset(long offset) {
+    return (size_t)(offset / sizeof(struct FCB)) % OFFSET_BUCKETS;
+}
+
+static struct DirIndex *find_index(uint16_t key) {
+    for (struct DirIndex *d = lru.next; d != &lru; d = d->next) {
+        if (d->key == key)
+            return d;
+    }
+    return NULL;
+}
+
+static void unlink_offset(struct IndexEntry *e) {
+    struct IndexEntry **p = &by_offset[hash_offset(e->offset)];
+    while (*p && *p != e)
+        p = &(*p)->offset_next;
+    if (*p)
+        *p = e->offset_next;
+}
+
+static void free_index(struct DirIndex *d) {
+    for (size_t i = 0; i < d->bucket_count; i++) {
+        struct IndexEntry *e = d->buckets[i];
+        while (e) {
+            struct IndexEntry *next = e->name_next;
+            if (d->linked)
+                unlink_offset(e);
+            free(e);
+            e = next;
+        }
+    }
+
+    if (d->linked) {
+        d->prev->next = d->next;
+        d->next->prev = d->prev;
+        nr_indexes--;
+    }
+    free(d->buckets);
+    free(d);
+}
+
+// 表项过多时扩大哈希表
+static int grow(struct DirIndex *d) {
+    size_t count = d->bucket_count * 2;
+    struct IndexEntry **buckets = calloc(count, sizeof(struct IndexEntry *));
+    if (!buckets)
+        return -ENOMEM;
+
+    for (size_t i = 0; i < d->bucket_count; i++) {
+        struct IndexEntry *e = d->buckets[i];
+        while (e) {
+            struct IndexEntry *next = e->name_next;
+            size_t h = hash_name(e->name) & (count - 1);
+            e->name_next = buckets[h];
+            buckets[h] = e;
+            e = next;
+        }
+    }
+
+    free(d->buckets);
+    d->buckets = buckets;
+    d->bucket_count = count;
+    return 0;
+}
+
+static void link_offset(struct IndexEntry *e) {
+    size_t h = hash_offset(e->offset);
+    e->offset_next = by_offset[h];
+    by_offset[h] = e;
+}
+
+static int insert(struct DirIndex *d, const struct FCB *fcb, long offset) {
+    if (d->count >= d->bucket_count * 2 && grow(d) < 0)
+        return -ENOMEM;
+
+    struct IndexEntry *e = malloc(sizeof(struct IndexEntry));
+    if (!e)
+        return -ENOMEM;
+
+    fcb_name(fcb, e->name);
+    e->offset = offset;
+    e->owner = d;
+
+    size_t h = hash_name(e->name) & (d->bucket_count - 1);
+    e->name_next = d->buckets[h];
+    d->buckets[h] = e;
+
+    if (d->linked)
+        link_offset(e);
+
+    d->count++;
+    return 0;
+}
+
+static void remove_entry(struct IndexEntry *e) {
+    struct DirIndex *d = e->owner;
+    struct IndexEntry **p = &d->buckets[hash_name(e->name) & (d->bucket_count - 1)];
+    while (*p && *p != e)
+        p = &(*p)->name_next;
+    if (*p)
+        *p = e->name_next;
+
+    unlink_offset(e);
+    free(e);
+    d->count--;
+}
+
+// 扫描目录时的回调
+static int build_callback(void *opt, long pos, int index, const struct FCB *fcb) {
+    struct DirIndex *d = opt;
+
+    if (!fcb || is_entry_end(fcb))
+        return 1;
+
+    if (is_entry_exists(fcb) && insert(d, fcb, pos + index * sizeof(struct FCB)) < 0) {
+        d->failed = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void lru_push(struct DirIndex *d) {
+    d->next = lru.next;
+    d->prev = &lru;
+    lru.next->prev = d;
+    lru.next = d;
+}
+
+// 扫描目录建立索引，不持有 index_lock，建立的索引尚未发布
+static struct DirIndex *build_index(uint16_t key, const struct FCB *dir) {
+    struct DirIndex *d = calloc(1, sizeof(struct DirIndex));
+    if (!d)
+        return NULL;
+    d->key = key;
+    d->bucket_count = 16;
+    if (!(d->buckets = calloc(d->bucket_count, sizeof(struct IndexEntry *)))) {
+        free(d);
+        return NULL;
+    }
+
+    int ret = dir ? traverse_sub_dir(dir, d, build_callback)
+                  : traverse_root_dir(d, build_callback);
+    if (ret < 0 || d->failed) {
+        free_index(d);
+        return NULL;
+    }
+    return d;
+}
+
+// 发布建立好的索引
+// 调用者持有 index_lock
+static void publish(struct DirIndex *d) {
+    if (nr_indexes >= MAX_INDEXED_DIRS)
+        free_index(lru.prev);
+
+    for (size_t i = 0; i < d->bucket_count; i++) {
+        for (struct IndexEntry *e = d->buckets[i]; e; e = e->name_next)
+            link_offset(e);
+    }
+    d->linked = 1;
+    lru_push(d);
+    nr_indexes++;
+}
+
+// 取得目录的索引，不存在时在锁外扫描目录建立
+// 调用者持有 index_lock，期间会暂时释放
+// 扫描期间目录可能被修改时不发布，*private 返回 1，索引只用于本次查找，用完后由调用者释放
+static struct DirIndex *get_index(uint16_t key, const struct FCB *dir, int *private) {
+    *private = 0;
+    struct DirIndex *d = find_index(key);
+    if (d) {    // 移到 LRU 表头
+        d->prev->next = d->next;
+        d->next->prev = d->prev;
+        lru_push(d);
+        return d;
+    }
+
+    building++;
+    unsigned long seen = changes;
+    pthread_mutex_unlock(&index_lock);
+    struct DirIndex *built = build_index(key, dir);
+    pthread_mutex_lock(&index_lock);
+    building--;
+
+    if (!built)
+        return NULL;
+
+    if ((d = find_index(key))) {    // 其他线程已经发布
+        free_index(built);
+        return d;
+    }
+
+    if (changes != seen) {
+        *private = 1;
+        return built;
+    }
+
+    publish(built);
+    return built;
+}
+
+int dir_index_find(uint16_t key, const struct FCB *dir, const char *name, struct FCB *fcb, long *offset) {
+    char target[NAME_LEN];
+    if (!to_fcb_name(name, target))
+        return 0;
+
+    if (dir && !is_cluster_inuse(key))  // 空目录
+        return 0;
+
+    int private;
+    pthread_mutex_lock(&index_lock);
+    struct DirIndex *d = get_index(key, dir, &private);
+    if (!d) {
+        pthread_mutex_unlock(&index_lock);
+        return -ENOMEM;
+    }
+
+    int ret = 0;
+    for (struct IndexEntry *e = d->buckets[hash_name(target) & (d->bucket_count - 1)]; e; e = e->name_next) {
+        if (!memcmp(e->name, target, NAME_LEN)) {
+            if (sizeof(struct FCB) != cache_read(fcb, e->offset, sizeof(struct FCB))) {
+                ret = -EIO;
+            } else {
+                *offset = e->offset;
+                ret = 1;
+            }
+            break;
+        }
+    }
+
+    if (private)
+        free_index(d);
+    pthread_mutex_unlock(&index_lock);
+    return ret;
+}
+
+static struct IndexEntry *find_offset(long offset) {
+    struct IndexEntry *e = by_offset[hash_offset(offset)];
+    while (e && e->offset != offset)
+        e = e->offset_next;
+    return e;
+}
+
+void dir_index_add(uint16_t key, const struct FCB *fcb, long offset) {
+    pthread_mutex_lock(&index_lock);
+    struct DirIndex *d = find_index(key);
+    if (d) {
+        // 并发建立的索引可能已经扫描到该项
+        struct IndexEntry *e = find_offset(offset);
+        if (e)
+            remove_entry(e);
+        if (insert(d, fcb, offset) < 0)
+            free_index(d);      // 索引不完整，下次重建
+    } else if (building) {
+        changes++;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void dir_index_update(long offset, const struct FCB *fcb) {
+    pthread_mutex_lock(&index_lock);
+    struct IndexEntry *e = find_offset(offset);
+
+    char name[NAME_LEN];
+    fcb_name(fcb, name);
+    if (e && memcmp(name, e->name, NAME_LEN)) {
+        // 被删除或改名
+        struct DirIndex *d = e->owner;
+        remove_entry(e);
+        if (!is_entry_end(fcb) && is_entry_exists(fcb) && insert(d, fcb, offset) < 0)
+            free_index(d);
+    } else if (!e && building) {    // 可能属于正在建立索引的目录
+        changes++;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void dir_index_drop(uint16_t key) {
+    pthread_mutex_lock(&index_lock);
+    struct DirIndex *d = find_index(key);
+    if (d)
+        free_index(d);
+    else if (building)
+        changes++;
+    pthread_mutex_unlock(&index_lock);
+}
+
+void dir_index_release() {
+    pthread_mutex_lock(&index_lock);
+    while (lru.next != &lru)
+        free_index(lru.next);
+    pthread_mutex_unlock(&index_lock);
+}
@@ -0,0 +1,26 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "fat16.h"
+
+// 目录名字索引
+// 第一次访问目录时扫描一遍，以规范化的 11 字节 8.3 名字为键建立哈希表，
+// 之后在该目录中查找文件不必再扫描目录的所有簇
+// 目录以起始簇为键，根目录为 DCACHE_ROOT；空目录（CLUSTER_END）不建立索引
+
+// 在目录中查找文件，dir 为目录的 FCB，根目录为 NULL
+// 返回 1 找到并填充 fcb 和 offset，0 不存在，负数为错误
+int dir_index_find(uint16_t key, const struct FCB *dir, const char *name, struct FCB *fcb, long *offset);
+
+// 目录中新建了 FCB
+void dir_index_add(uint16_t key, const struct FCB *fcb, long offset);
+
+// offset 处的 FCB 被改写，被删除时从索引中移除
+void dir_index_update(long offset, const struct FCB *fcb);
+
+// 目录被删除，丢弃它的索引
+void dir_index_drop(uint16_t key);
+
+void dir_index_release();
+
+#endif
@@ -0,0 +1,131 @@
+#include "extent.h"
+#include "utils.h"
+#include "alloc.h"
+#include "fat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+void extent_map_init(struct ExtentMap *map) {
+    memset(map, 0, sizeof(struct ExtentMap));
+    pthread_mutex_init(&map->lock, NULL);
+}
+
+static int append_extent(struct ExtentMap *map, uint32_t index, uint16_t cluster) {
+    if (map->count == map->capacity) {
+        uint32_t capacity = map->capacity ? map->capacity * 2 : 8;
+        struct Extent *extents = realloc(map->extents, capacity * sizeof(struct Extent));
+        if (!extents)
+            return -ENOMEM;
+
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+
+    struct Extent *e = &map->extents[map->count++];
+    e->index = index;
+    e->cluster = cluster;
+    e->length = 1;
+    return 0;
+}
+
+// 沿簇链把 cur 开始的簇加到映射末尾，调用者持有 FAT 锁
+static int append_chain(struct ExtentMap *map, uint16_t cur) {
+    uint32_t limit = alloc_cluster_limit();   // 防止簇链成环
+    while (is_cluster_inuse(cur) && map->clusters < limit) {
+        struct Extent *tail = map->count ? &map->extents[map->count - 1] : NULL;
+        if (tail && tail->cluster + tail->length == cur) {
+            tail->length++;
+        } else if (append_extent(map, map->clusters, cur) < 0) {
+            return -ENOMEM;
+        }
+
+        map->clusters++;
+        cur = fat_get(cur);
+    }
+    return 0;
+}
+
+int extent_map_build(struct ExtentMap *map, uint16_t first_cluster) {
+    map->count = 0;
+    map->clusters = 0;
+    map->last = 0;
+    map->valid = 0;
+
+    fat_lock_shared();
+    int ret = append_chain(map, first_cluster);
+    fat_unlock();
+
+    map->valid = ret == 0;
+    return ret;
+}
+
+uint16_t extent_map_tail(const struct ExtentMap *map) {
+    if (!map->valid || map->count == 0)
+        return CLUSTER_END;
+
+    const struct Extent *e = &map->extents[map->count - 1];
+    return e->cluster + e->length - 1;
+}
+
+int extent_map_extend(struct ExtentMap *map, uint16_t first_cluster) {
+    return append_chain(map, first_cluster);
+}
+
+void extent_map_truncate(struct ExtentMap *map, uint32_t clusters) {
+    if (!map->valid || clusters >= map->clusters)
+        return;
+
+    while (map->count > 0 && map->extents[map->count - 1].index >= clusters)
+        map->count--;
+    if (map->count > 0) {
+        struct Extent *e = &map->extents[map->count - 1];
+        if (e->index + e->length > clusters)
+            e->length = clusters - e->index;
+    }
+
+    map->clusters = clusters;
+    map->last = 0;
+}
+
+static int contains(const struct Extent *e, uint32_t index) {
+    return e->index <= index && index < e->index + e->length;
+}
+
+int extent_map_find(struct ExtentMap *map, uint32_t index) {
+    if (!map->valid || index >= map->clusters)
+        return -1;
+
+    // 顺序访问通常落在上次的 extent 或其后一个
+    if (map->last < map->count && contains(&map->extents[map->last], index))
+        return map->last;
+    if (map->last + 1 < map->count && contains(&map->extents[map->last + 1], index))
+        return ++map->last;
+
+    uint32_t lo = 0, hi = map->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct Extent *e = &map->extents[mid];
+        if (index < e->index) {
+            hi = mid;
+        } else if (index >= e->index + e->length) {
+            lo = mid + 1;
+        } else {
+            map->last = mid;
+            return mid;
+        }
+    }
+
+    return -1;
+}
+
+void extent_map_invalidate(struct ExtentMap *map) {
+    map->valid = 0;
+}
+
+void extent_map_free(struct ExtentMap *map) {
+    free(map->extents);
+    pthread_mutex_destroy(&map->lock);
+    extent_map_init(map);
+}
@@ -0,0 +1,53 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// 一段物理上连续的簇
+struct Extent {
+    uint32_t index;     // 第一簇在文件内的簇序号
+    uint16_t cluster;   // 第一簇的簇号
+    uint32_t length;    // 簇数量
+};
+
+// 文件的 extent 映射，根据 FAT 表按需建立，簇链变化后需要失效
+struct ExtentMap {
+    struct Extent *extents;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t clusters;  // 簇总数
+    uint32_t last;      // 上次命中的 extent，顺序访问时直接命中
+    int valid;
+    pthread_mutex_t lock;   // 同一文件的多个读者共享映射，建立与查找时加锁
+    int pinned;             // 可能仍在从 image splice 本文件簇的句柄数
+    uint16_t deferred;      // pinned 期间截掉的簇，链在一起，pinned 归零时释放
+};
+
+void extent_map_init(struct ExtentMap *map);
+
+// 沿簇链建立映射，期间持有 FAT 读锁
+// 0:成功 负数:失败
+int extent_map_build(struct ExtentMap *map, uint16_t first_cluster);
+
+// 二分查找包含文件内第 index 簇的 extent
+// 返回 extent 下标，-1 表示超出簇链
+int extent_map_find(struct ExtentMap *map, uint32_t index);
+
+// 最后一簇的簇号，映射无效或为空时返回 CLUSTER_END
+uint16_t extent_map_tail(const struct ExtentMap *map);
+
+// 簇链末尾追加了以 first_cluster 开始的新簇，只遍历新簇
+// 调用者持有 FAT 写锁，失败时需使映射失效
+// 0:成功 负数:失败
+int extent_map_extend(struct ExtentMap *map, uint16_t first_cluster);
+
+// 簇链被截断为 clusters 簇
+void extent_map_truncate(struct ExtentMap *map, uint32_t clusters);
+
+// 簇链被修改，下次访问时重建
+void extent_map_invalidate(struct ExtentMap *map);
+
+void extent_map_free(struct ExtentMap *map);
+
+#endif
@@ -0,0 +1,167 @@
+#include "fat.h"
+#include "fat16.h"
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+static uint16_t *fat_table;     // 内存中的 FAT 表
+static uint8_t *fat_dirty;      // 每个扇区一个标记，见 SECTOR_*
+static size_t fat_sectors;      // FAT 表占用的扇区数
+static size_t sector_size;
+static pthread_rwlock_t fat_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define SECTOR_CLEAN     0
+#define SECTOR_DIRTY     1      // 需要写回
+#define SECTOR_COLLECTED 2      // 已由日志提交取出，日志落盘之前仍需保留
+
+void fat_lock_shared() {
+    pthread_rwlock_rdlock(&fat_lock);
+}
+
+void fat_lock_exclusive() {
+    pthread_rwlock_wrlock(&fat_lock);
+}
+
+void fat_unlock() {
+    pthread_rwlock_unlock(&fat_lock);
+}
+
+int fat_load() {
+    sector_size = boot_record.bpb.bytes_per_sector;
+    fat_sectors = size_fat / sector_size;
+
+    fat_table = malloc(size_fat);
+    fat_dirty = calloc(fat_sectors, sizeof(uint8_t));
+    if (!fat_table || !fat_dirty) {
+        fat_release();
+        return -ENOMEM;
+    }
+
+    if (size_fat != io_read(fat_table, offset_fat, size_fat)) {
+        fat_release();
+        return -EIO;
+    }
+
+    return 0;
+}
+
+uint16_t fat_get(uint16_t cluster) {
+    if (!fat_table || cluster >= fat_entries())
+        return CLUSTER_END;
+
+    return fat_table[cluster];
+}
+
+void fat_set(uint16_t cluster, uint16_t value) {
+    if (!fat_table || cluster >= fat_entries())
+        return;
+
+    fat_table[cluster] = value;
+    fat_dirty[cluster * sizeof(uint16_t) / sector_size] = SECTOR_DIRTY;
+}
+
+size_t fat_entries() {
+    return size_fat / sizeof(uint16_t);
+}
+
+int fat_flush() {
+    if (!fat_table)
+        return 0;
+
+    // 写回期间表项不能被修改，同时避免两次写回交错
+    fat_lock_exclusive();
+    int ret = 0;
+    size_t i = 0;
+    while (i < fat_sectors) {
+        if (!fat_dirty[i]) {
+            i++;
+            continue;
+        }
+
+        // 合并连续的脏扇区，一次写回
+        size_t end = i;
+        while (end < fat_sectors && fat_dirty[end])
+            end++;
+
+        size_t len = (end - i) * sector_size;
+        void *src = (char *)fat_table + i * sector_size;
+        for (int n = 0; n < boot_record.bpb.number_of_fat; n++) {
+            long pos = offset_fat + n * size_fat + i * sector_size;
+            if (len != io_write(src, pos, len)) {
+                ret = -EIO;
+                goto out;
+            }
+        }
+
+        memset(fat_dirty + i, 0, end - i);
+        i = end;
+    }
+
+out:
+    fat_unlock();
+    return ret;
+}
+
+int fat_collect(int (*emit)(void *ctx, long pos, const void *data, size_t len), void *ctx) {
+    if (!fat_table)
+        return 0;
+
+    // 先交出所有脏扇区，全部成功后才标记，失败时不改变任何扇区的状态
+    fat_lock_exclusive();
+    int ret = 0;
+    size_t i = 0;
+    while (i < fat_sectors) {
+        if (fat_dirty[i] != SECTOR_DIRTY) {
+            i++;
+            continue;
+        }
+
+        size_t end = i;
+        while (end < fat_sectors && fat_dirty[end] == SECTOR_DIRTY)
+            end++;
+
+        size_t len = (end - i) * sector_size;
+        void *src = (char *)fat_table + i * sector_size;
+        for (int n = 0; n < boot_record.bpb.number_of_fat; n++) {
+            long pos = offset_fat + n * size_fat + i * sector_size;
+            if ((ret = emit(ctx, pos, src, len)) < 0)
+                goto out;
+        }
+        i = end;
+    }
+
+    for (i = 0; i < fat_sectors; i++) {
+        if (fat_dirty[i] == SECTOR_DIRTY)
+            fat_dirty[i] = SECTOR_COLLECTED;
+    }
+
+out:
+    fat_unlock();
+    return ret;
+}
+
+void fat_collect_done(int written) {
+    if (!fat_table)
+        return;
+
+    // 取出之后又被修改的扇区已重新标记为脏
+    fat_lock_exclusive();
+    for (size_t i = 0; i < fat_sectors; i++) {
+        if (fat_dirty[i] == SECTOR_COLLECTED)
+            fat_dirty[i] = written ? SECTOR_CLEAN : SECTOR_DIRTY;
+    }
+    fat_unlock();
+}
+
+void fat_release() {
+    if (fat_table && fat_dirty)
+        fat_flush();
+
+    free(fat_table);
+    free(fat_dirty);
+    fat_table = NULL;
+    fat_dirty = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 将整个 FAT 表读入内存
+// 0:成功 负数:失败
+int fat_load();
+
+// FAT 表与空闲簇分配器共用的读写锁
+// 沿簇链读取时持有读锁，分配、释放、链接簇时持有写锁
+void fat_lock_shared();
+void fat_lock_exclusive();
+void fat_unlock();
+
+// 读取 FAT 表项，调用者需持有锁
+// 返回簇号，越界返回 CLUSTER_END
+uint16_t fat_get(uint16_t cluster);
+
+// 修改 FAT 表项，只修改内存并标记所在扇区为脏，调用者需持有写锁
+void fat_set(uint16_t cluster, uint16_t value);
+
+// FAT 表项数量
+size_t fat_entries();
+
+// 将脏扇区写回 image 中的所有 FAT 副本
+// 0:成功 负数:失败
+int fat_flush();
+
+// 日志提交时取出所有脏扇区，不写回 image
+// 每个 FAT 副本调用一次 emit，传入的 pos 为其在 image 的偏移，之后扇区标记为已取出
+// 0:成功 负数:emit 失败，所有扇区保持原样
+int fat_collect(int (*emit)(void *ctx, long pos, const void *data, size_t len), void *ctx);
+
+// 结束一次提交，written 为 1 时取出的扇区已写入日志，标记为干净；否则恢复为脏，由下次提交重新取出
+void fat_collect_done(int written);
+
+// 写回并释放内存中的 FAT 表
+void fat_release();
+
+#endif
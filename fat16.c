@@ -2,11 +2,26 @@
 #include "options.h"
 #include "io.h"
 #include "utils.h"
+#include "fat.h"
+#include "alloc.h"
+#include "file.h"
+#include "cache.h"
+#include "dcache.h"
+#include "dirindex.h"
+#include "lock.h"
+#include "journal.h"
+#include "readahead.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/falloc.h>
+
+#define COPY_CHUNK (1 << 20)    // copy_file_range 每次复制的长度
+#define SPLICE_MIN (64 << 10)   // read_buf 中不小于此长度的读从 image 直接 splice
 
 struct BootRecord boot_record;
 long offset_root;
@@ -16,14 +31,52 @@ size_t size_fat;
 size_t size_cluster;
 size_t fcb_per_cluster;
 
+static pthread_t flusher;
+static int flusher_running;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_stop = PTHREAD_COND_INITIALIZER;
+
+// 定时写回打开文件的 FCB、FAT 表和缓存中的脏块
+static void *flusher_main(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&flusher_lock);
+    while (flusher_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += g_options.flush_interval;
+        if (pthread_cond_timedwait(&flusher_stop, &flusher_lock, &ts) != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_unlock(&flusher_lock);
+        if (journal_enabled()) {
+            journal_commit();
+        } else {
+            file_sync_all();
+            fat_flush();
+            cache_flush();
+        }
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
 void *fat16_init (struct fuse_conn_info *conn, struct fuse_config *cfg) {
 
     cfg->kernel_cache = 1;
 
+    // readdir 时一并返回属性，列目录不再对每一项调用 getattr
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+
     fuse_log(FUSE_LOG_INFO, "fat16_init: image file %s\n",g_options.filename );
 
     // open image file
-    if(init_myio(g_options.filename) < 0){
+    int io_mode = g_options.use_mmap ? IO_MODE_MMAP : g_options.use_uring ? IO_MODE_URING : IO_MODE_PREAD;
+    if(init_myio(g_options.filename, io_mode) < 0){
         fuse_log(FUSE_LOG_ERR, "FAT16 SYSTEM: failed to load image!");
         abort();
     }
@@ -46,17 +99,130 @@ void *fat16_init (struct fuse_conn_info *conn, struct fuse_config *cfg) {
     offset_data = offset_root + boot_record.bpb.root_entries * sizeof(struct FCB);
     fcb_per_cluster = size_cluster / sizeof(struct FCB); //每簇的目录项
 
+    dir_lock_init();
+
     fuse_log(FUSE_LOG_DEBUG, "FAT16 SYSTEM: FAT 偏移: %d\n", offset_fat);
     fuse_log(FUSE_LOG_DEBUG, "FAT16 SYSTEM: ROOT 偏移: %d\n", offset_root);
 
+    // 元数据日志，需在读入 FAT 表之前重放
+    if (g_options.journal && g_options.cache_size == 0) {
+        fuse_log(FUSE_LOG_WARNING, "FAT16 SYSTEM: journal requires the buffer cache, disabled\n");
+    } else if (g_options.journal && journal_open(g_options.journal) < 0) {
+        fuse_log(FUSE_LOG_ERR, "FAT16 SYSTEM: failed to open journal %s!", g_options.journal);
+        abort();
+    }
+
+    // 常驻内存的 FAT 表
+    if (fat_load() < 0) {
+        fuse_log(FUSE_LOG_ERR, "FAT16 SYSTEM: failed to load FAT!");
+        abort();
+    }
+
+    // 空闲簇位图
+    if (alloc_init() < 0) {
+        fuse_log(FUSE_LOG_ERR, "FAT16 SYSTEM: failed to build free cluster map!");
+        abort();
+    }
+
+    // 目录与小文件的缓冲区缓存
+    if (cache_init((size_t)g_options.cache_size << 20) < 0) {
+        fuse_log(FUSE_LOG_ERR, "FAT16 SYSTEM: failed to allocate buffer cache!");
+        abort();
+    }
+
+    // 根目录的空闲目录项计数
+    if (count_root_entries() < 0) {
+        fuse_log(FUSE_LOG_ERR, "FAT16 SYSTEM: failed to read root directory!");
+        abort();
+    }
+
+    if (readahead_start() < 0)
+        fuse_log(FUSE_LOG_WARNING, "FAT16 SYSTEM: failed to start readahead\n");
+
+    if (g_options.flush_interval > 0) {
+        flusher_running = 1;
+        if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+            fuse_log(FUSE_LOG_WARNING, "FAT16 SYSTEM: failed to start metadata flusher\n");
+            flusher_running = 0;
+        }
+    }
+
     return NULL;
 }
 
 void release()
 {
+	if (flusher_running) {
+		pthread_mutex_lock(&flusher_lock);
+		flusher_running = 0;
+		pthread_cond_signal(&flusher_stop);
+		pthread_mutex_unlock(&flusher_lock);
+		pthread_join(flusher, NULL);
+	}
+
+	readahead_stop();
+	file_release_all();
+	journal_close();
+	dcache_release();
+	dir_index_release();
+	alloc_release();
+	fat_release();
+	cache_release();
 	io_release();
 }
 
+// 取出 open/create 时保存的文件句柄
+static struct FileHandle *get_handle(struct fuse_file_info *fi) {
+    return fi ? (struct FileHandle *)(uintptr_t)fi->fh : NULL;
+}
+
+// 写回缓存中的脏块、file 的 FCB 和 FAT 表，durable 为 1 时落盘
+// ordered 与 sync 模式下数据块先于元数据落盘
+static int write_back(struct OpenFile *file, int durable, int datasync) {
+    int ret;
+    if (journal_enabled()) {
+        // 元数据经日志写回；FCB 先写入缓存，由下一次提交带走
+        if (file) {
+            journal_begin();
+            pthread_rwlock_wrlock(&file->lock);
+            ret = open_file_sync(file);
+            pthread_rwlock_unlock(&file->lock);
+            journal_end();
+            if (ret < 0)
+                return ret;
+        }
+        // 提交时数据先于元数据落盘
+        return durable ? journal_commit() : 0;
+    }
+
+    if ((ret = cache_flush()) < 0)
+        return ret;
+    if (durable && g_options.durability != DURABILITY_WRITEBACK && (ret = io_sync(1)) < 0)
+        return ret;
+
+    if (file) {
+        pthread_rwlock_wrlock(&file->lock);
+        ret = open_file_sync(file);
+        pthread_rwlock_unlock(&file->lock);
+        if (ret < 0)
+            return ret;
+    }
+
+    if ((ret = fat_flush()) < 0 || (ret = cache_flush()) < 0)
+        return ret;
+
+    return durable ? io_sync(datasync) : 0;
+}
+
+// sync 模式下修改操作成功后立即落盘
+static int commit(struct OpenFile *file, int ret) {
+    if (ret < 0 || g_options.durability != DURABILITY_SYNC)
+        return ret;
+
+    int err = write_back(file, 1, 1);
+    return err < 0 ? err : ret;
+}
+
 int fat16_readdir(const char *path, 
     void *buf, 
     fuse_fill_dir_t filler, 
@@ -67,7 +233,6 @@ int fat16_readdir(const char *path,
     // 未使用的变量会报 warning
 	(void) offset;
 	(void) fi;
-	(void) flags;
 	fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: readdir读取目录: %s \n", path);
 
     
@@ -77,6 +242,7 @@ int fat16_readdir(const char *path,
     struct ReadDirOption opt = {
 		.filler = filler,
 		.buf = buf,
+		.flags = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0,
 	};
     
     if (!strcmp(path, "/")) {   // 根目录
@@ -113,25 +279,32 @@ int fat16_getattr(const char* path, struct stat* st, struct fuse_file_info* fi)
 
 	struct FCB fcb;
 	long result;
+	struct FileHandle *fh = get_handle(fi);
+	struct OpenFile *opened;
 
 	if (!strcmp(path, "/")) {   // 根目录
 		st->st_mode = S_IFDIR | 0755;
 		st->st_nlink = 2;
 	} else {
-		if ((result = find_fcb(path, &fcb)) < 0)
+		if (fh) {   // 已打开的文件直接使用句柄中的 FCB
+			pthread_rwlock_rdlock(&fh->file->lock);
+			fcb = fh->file->fcb;
+			pthread_rwlock_unlock(&fh->file->lock);
+		} else if ((result = find_fcb(path, &fcb)) < 0) {
 			return (int)result;
+		} else if ((opened = open_file_get(result))) {  // 已打开文件的 FCB 可能尚未写回
+			pthread_rwlock_rdlock(&opened->lock);
+			fcb = opened->fcb;
+			pthread_rwlock_unlock(&opened->lock);
+			journal_begin();    // 最后一个引用可能释放预留的簇
+			open_file_put(opened);
+			journal_end();
+		}
 
         if ((fcb.metadata & META_VOLUME_LABEL))
             return -ENOENT;
 
-		if ((fcb.metadata & META_DIRECTORY)) {  // 子目录
-			st->st_mode = S_IFDIR | 0755;
-			st->st_nlink = 2;
-		} else {    // 普通文件
-			st->st_mode = 0777 | S_IFREG;
-			st->st_nlink = 1;
-			st->st_size = fcb.size;
-		}
+		fill_stat(&fcb, st);
 	}
 
 	return 0;
@@ -155,11 +328,29 @@ int fat16_open(const char* path, struct fuse_file_info* fi) {
 	if ((ret = find_fcb(path, &fcb)) < 0)
 		return -ENOENT;
 
-    int result;
-    if (fi->flags & O_TRUNC && 0 != (result = _truncate(&fcb, ret, 0))) {
-        return result;
+    struct FileHandle *fh = file_handle_new(ret, &fcb);
+    if (!fh)
+        return -ENOMEM;
+
+    if (fi->flags & O_TRUNC) {
+        struct OpenFile *file = fh->file;
+        journal_begin();
+        pthread_rwlock_wrlock(&file->lock);
+        int result = _truncate(&file->fcb, file->fcb_offset, &file->map, 0);
+        if (result < 0)
+            open_file_invalidate(file);
+        pthread_rwlock_unlock(&file->lock);
+        journal_end();
+
+        if ((result = commit(NULL, result)) != 0) {
+            journal_begin();
+            file_handle_free(fh);
+            journal_end();
+            return result;
+        }
     }
 
+    fi->fh = (uintptr_t)fh;
 	return 0;   // 找到文件
 }
 
@@ -168,6 +359,20 @@ int fat16_read(const char *path, char *buf, size_t size, off_t offset, struct fu
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: read读取文件 %s\n", path);
 
     struct FCB fcb;
+    struct FileHandle *fh = get_handle(fi);
+
+    if (fh) {
+        struct OpenFile *file = fh->file;
+        if (file->fcb.metadata & META_DIRECTORY)
+            return -EISDIR;
+
+        pthread_rwlock_rdlock(&file->lock);
+        int ret = read_file(&file->fcb, &file->map, buf, offset, size);
+        pthread_rwlock_unlock(&file->lock);
+        if (ret > 0)
+            readahead_update(&fh->ra, file, offset, ret);
+        return ret;
+    }
 
     if(find_fcb(path, &fcb) < 0) {
         return -ENOENT;
@@ -176,7 +381,145 @@ int fat16_read(const char *path, char *buf, size_t size, off_t offset, struct fu
     if (fcb.metadata & META_DIRECTORY)
         return -EISDIR;
 
-    return read_file(&fcb, buf, offset, size);
+    return read_file(&fcb, NULL, buf, offset, size);
+}
+
+// 取得 fi 中的句柄，未经句柄调用时临时打开，*tmp 用完后以 file_handle_free 释放
+// 失败返回 NULL，err 返回错误码
+static struct FileHandle *hold_handle(const char *path, struct fuse_file_info *fi, struct FileHandle **tmp, int *err) {
+    *tmp = NULL;
+    struct FileHandle *fh = get_handle(fi);
+    if (fh)
+        return fh;
+
+    if (strcmp(path, "/") == 0) {
+        *err = -EISDIR;
+        return NULL;
+    }
+
+    struct FCB fcb;
+    long result = find_fcb(path, &fcb);
+    if (result < 0) {
+        *err = (int)result;
+        return NULL;
+    }
+
+    if (!(*tmp = file_handle_new(result, &fcb)))
+        *err = -ENOMEM;
+    return *tmp;
+}
+
+// 释放 read_buf 中分配的内存段与 bufvec，与 libfuse 的释放方式相同
+static void free_bufvec(struct fuse_bufvec *vec) {
+    for (size_t i = 0; i < vec->count; i++) {
+        if (!(vec->buf[i].flags & FUSE_BUF_IS_FD))
+            free(vec->buf[i].mem);
+    }
+    free(vec);
+}
+
+// 大块读返回 image 文件描述符上的段，由 libfuse 从 image splice 给内核，不经过用户态复制
+// 缓存中尚未写回 image 的段从缓存复制到内存段；小块读与 fat16_read 相同，经过缓存读取
+// 两种读都更新预读窗口：小块读预读到缓冲区缓存，大块读只提示内核把后续的簇读入 image 的页缓存
+// 各段的位置在读锁内确定，splice 在返回之后、不持有任何锁时进行。为免这期间截断释放的簇
+// 被另一个文件重用、读者读到其他文件的数据，返回 image 上的段之前先 pin 文件的簇，
+// 截掉的簇推迟到句柄关闭时才释放（内核在句柄的读请求完成之后才发送 release）。
+// 没有 fi 的临时句柄在返回前就已关闭，因此全部复制到内存段
+int fat16_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: read_buf读取文件 %s\n", path);
+
+    struct FileHandle *tmp;
+    int ret;
+    struct FileHandle *fh = hold_handle(path, fi, &tmp, &ret);
+    if (!fh)
+        return ret;
+
+    struct OpenFile *file = fh->file;
+    struct IoRequest *segs = NULL;
+    int max = size < SPLICE_MIN ? 1 : size / size_cluster + 2;
+    struct fuse_bufvec *vec = malloc(sizeof(*vec) + (max - 1) * sizeof(struct fuse_buf));
+    ret = -ENOMEM;
+    if (!vec)
+        goto out;
+    *vec = FUSE_BUFVEC_INIT(0);
+
+    ret = -EISDIR;
+    if (file->fcb.metadata & META_DIRECTORY)
+        goto out;
+
+    if (size < SPLICE_MIN) {
+        ret = -ENOMEM;
+        if (!(vec->buf[0].mem = malloc(size ? size : 1)))
+            goto out;
+
+        pthread_rwlock_rdlock(&file->lock);
+        ret = read_file(&file->fcb, &file->map, vec->buf[0].mem, offset, size);
+        pthread_rwlock_unlock(&file->lock);
+        if (ret < 0)
+            goto out;
+        vec->buf[0].size = ret;
+        ret = 0;
+        goto done;
+    }
+
+    ret = -ENOMEM;
+    if (!(segs = malloc(max * sizeof(*segs))))
+        goto out;
+
+    // 持有读锁期间确定各段的位置，见函数前的说明
+    pthread_rwlock_rdlock(&file->lock);
+    int count = locate_file(&file->fcb, &file->map, offset, size, segs, max);
+    ret = count < 0 ? count : 0;
+    for (int i = 0; i < count; i++) {
+        struct fuse_buf *b = &vec->buf[i];
+        *b = (struct fuse_buf){ .size = segs[i].size, .fd = -1 };
+        vec->count = i + 1;
+
+        if (!tmp && cache_is_clean(segs[i].offset, segs[i].size)) {
+            pin_clusters(&file->map, &fh->pinned);
+            b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            b->fd = io_fd();
+            b->pos = segs[i].offset;
+            continue;
+        }
+
+        if (!(b->mem = malloc(b->size))) {
+            ret = -ENOMEM;
+            break;
+        }
+        if (cache_read(b->mem, segs[i].offset, b->size) != b->size) {
+            ret = -EIO;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&file->lock);
+
+done:
+    if (ret == 0 && !tmp) {
+        size_t total = 0;
+        for (size_t i = 0; i < vec->count; i++)
+            total += vec->buf[i].size;
+        if (size < SPLICE_MIN)
+            readahead_update(&fh->ra, file, offset, total);
+        else
+            readahead_advise(&fh->ra, file, offset, total);
+    }
+
+out:
+    free(segs);
+    if (tmp) {
+        journal_begin();
+        file_handle_free(tmp);
+        journal_end();
+    }
+    if (ret < 0) {
+        if (vec)
+            free_bufvec(vec);
+        return ret;
+    }
+
+    *bufp = vec;
+    return 0;
 }
 
 int fat16_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
@@ -185,6 +528,28 @@ int fat16_write(const char *path, const char *buf, size_t size, off_t offset, st
     if (strcmp(path, "/") == 0)
         return -EISDIR;
 
+    if (size > INT32_MAX)
+        return -EINVAL;
+
+    struct FileHandle *fh = get_handle(fi);
+    if (fh) {
+        struct OpenFile *file = fh->file;
+        if (file->fcb.metadata & META_DIRECTORY)
+            return -EISDIR;
+
+        // FCB 只在内存中修改，flush、release 或定时写回
+        journal_begin();
+        pthread_rwlock_wrlock(&file->lock);
+        uint32_t old_size = file->fcb.size;
+        uint16_t old_first = file->fcb.first_cluster;
+        int ret = write_file(&file->fcb, -1, &file->map, buf, offset, size);
+        if (file->fcb.size != old_size || file->fcb.first_cluster != old_first)
+            file->dirty = 1;
+        pthread_rwlock_unlock(&file->lock);
+        journal_end();
+        return commit(file, ret);
+    }
+
     struct FCB file;
     long result = find_fcb(path, &file);
 
@@ -194,25 +559,184 @@ int fat16_write(const char *path, const char *buf, size_t size, off_t offset, st
     if (file.metadata & META_DIRECTORY)    // 不处理目录
         return -EISDIR;
 
-    if (size > INT32_MAX)
+    journal_begin();
+    int ret = write_file(&file, result, NULL, buf, offset, size);
+    journal_end();
+    return commit(NULL, ret);
+}
+
+int fat16_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: fallocate预分配 %s\n", path);
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
+
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+
+    if (offset > UINT32_MAX || length > (off_t)UINT32_MAX - offset)    // FCB 中的大小只有 32 位
+        return -EFBIG;
+
+    struct FileHandle *tmp;
+    int ret;
+    struct FileHandle *fh = hold_handle(path, fi, &tmp, &ret);
+    if (!fh)
+        return ret;
+
+    struct OpenFile *file = fh->file;
+    ret = -EISDIR;
+    journal_begin();
+    pthread_rwlock_wrlock(&file->lock);
+    if (!(file->fcb.metadata & META_DIRECTORY)) {
+        uint32_t old_size = file->fcb.size;
+        uint16_t old_first = file->fcb.first_cluster;
+        int keep_size = mode & FALLOC_FL_KEEP_SIZE;
+        ret = allocate_file(&file->fcb, -1, &file->map, offset + length, keep_size);
+        if (file->fcb.size != old_size || file->fcb.first_cluster != old_first)
+            file->dirty = 1;
+        if (keep_size && ret == 0)
+            file->preallocated = 1;
+    }
+    pthread_rwlock_unlock(&file->lock);
+    file_handle_free(tmp);
+    journal_end();
+    return commit(fh == tmp ? NULL : file, ret);
+}
+
+// 在 image 内复制文件内容，数据不经过内核与 FUSE
+// 分段复制，读时只持有源文件的读锁，写时只持有目标文件的写锁，不会同时持有两把文件锁
+ssize_t fat16_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+    const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: copy_file_range复制 %s -> %s\n", path_in, path_out);
+
+    if (flags != 0 || offset_in < 0 || offset_out < 0)
         return -EINVAL;
 
-    return write_file(&file, result, buf, offset, size);
+    if (size > UINT32_MAX || offset_out > (off_t)(UINT32_MAX - size))   // FCB 中的大小只有 32 位
+        return -EFBIG;
+
+    struct FileHandle *tmp_in, *tmp_out;
+    int ret;
+    struct FileHandle *in = hold_handle(path_in, fi_in, &tmp_in, &ret);
+    if (!in)
+        return ret;
+    struct FileHandle *out = hold_handle(path_out, fi_out, &tmp_out, &ret);
+    if (!out) {
+        journal_begin();
+        file_handle_free(tmp_in);
+        journal_end();
+        return ret;
+    }
+
+    struct OpenFile *src = in->file;
+    struct OpenFile *dst = out->file;
+    char *buf = NULL;
+    size_t done = 0;
+
+    ret = -EISDIR;
+    if ((src->fcb.metadata & META_DIRECTORY) || (dst->fcb.metadata & META_DIRECTORY))
+        goto out;
+
+    // 同一文件内重叠的范围无法分段复制
+    ret = -EINVAL;
+    if (src == dst && offset_in < offset_out + (off_t)size && offset_out < offset_in + (off_t)size)
+        goto out;
+
+    // 只复制源文件中存在的部分
+    pthread_rwlock_rdlock(&src->lock);
+    size_t avail = offset_in < src->fcb.size ? src->fcb.size - offset_in : 0;
+    pthread_rwlock_unlock(&src->lock);
+    if (size > avail)
+        size = avail;
+
+    ret = 0;
+    if (size == 0)
+        goto out;
+
+    ret = -ENOMEM;
+    if (!(buf = malloc(size < COPY_CHUNK ? size : COPY_CHUNK)))
+        goto out;
+
+    // 一次为目标分配所有的簇，尽量连续；未用完的簇在关闭时释放
+    journal_begin();
+    pthread_rwlock_wrlock(&dst->lock);
+    uint16_t old_first = dst->fcb.first_cluster;
+    ret = allocate_file(&dst->fcb, -1, &dst->map, offset_out + size, 1);
+    if (dst->fcb.first_cluster != old_first)
+        dst->dirty = 1;
+    if (ret == 0)
+        dst->preallocated = 1;
+    pthread_rwlock_unlock(&dst->lock);
+    journal_end();
+    if (ret < 0)
+        goto out;
+
+    while (done < size) {
+        size_t n = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+
+        pthread_rwlock_rdlock(&src->lock);
+        ret = read_file(&src->fcb, &src->map, buf, offset_in + done, n);
+        pthread_rwlock_unlock(&src->lock);
+        if (ret <= 0)   // 源文件在复制期间被截断
+            break;
+
+        n = ret;
+        journal_begin();
+        pthread_rwlock_wrlock(&dst->lock);
+        uint32_t old_size = dst->fcb.size;
+        old_first = dst->fcb.first_cluster;
+        ret = write_file(&dst->fcb, -1, &dst->map, buf, offset_out + done, n);
+        if (dst->fcb.size != old_size || dst->fcb.first_cluster != old_first)
+            dst->dirty = 1;
+        pthread_rwlock_unlock(&dst->lock);
+        journal_end();
+        if (ret < 0)
+            break;
+
+        done += n;
+    }
+
+out:
+    free(buf);
+    journal_begin();
+    file_handle_free(tmp_in);
+    file_handle_free(tmp_out);
+    journal_end();
+    if (done == 0)
+        return ret;
+
+    ret = commit(tmp_out ? NULL : dst, 0);
+    return ret < 0 ? ret : (ssize_t)done;
 }
 
 int fat16_flush(const char *path, struct fuse_file_info *fi) {
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: flush清空: %s\n", path);
-    (void) fi;
-    return 0;
+
+    // writeback 模式下 close 只写回 image，不等待落盘
+    struct FileHandle *fh = get_handle(fi);
+    return write_back(fh ? fh->file : NULL, g_options.durability != DURABILITY_WRITEBACK, 0);
 }
 
+int fat16_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: fsync同步: %s\n", path);
 
-int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: create创建文件: %s\n", path);
+    struct FileHandle *fh = get_handle(fi);
+    return write_back(fh ? fh->file : NULL, 1, datasync);
+}
+
+int fat16_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: fsyncdir同步目录: %s\n", path);
 
-    (void) mode;
     (void) fi;
 
+    // 目录项都写入了缓存，写回缓存即可
+    return write_back(NULL, 1, datasync);
+}
+
+
+static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void) mode;
+
     if (strcmp(path, "/") == 0)
         return -EINVAL;
 
@@ -239,6 +763,7 @@ int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     //     return -EINVAL;
 
     struct FindOption opt;  // 获取 pos 和 index
+    uint16_t parent_key = DCACHE_ROOT;  // 父目录在目录项缓存中的键
 
     // 查询可用空项
     if (*parent == '\0') {   // rootdir
@@ -259,14 +784,15 @@ int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         }
 
         if (opt.pos < 0) { // 给目录文件扩个容
-            uint16_t new_cluster = file_new_cluster(&parent_fcb, 1);
-            if (sizeof(struct FCB) != io_write(&parent_fcb, parent_offset, sizeof(struct FCB))) {
+            uint16_t new_cluster = file_new_cluster(&parent_fcb, NULL, 1, 1);
+            if (write_fcb(&parent_fcb, parent_offset) < 0) {
                 free(tmp);
                 return -EIO;
             }
             opt.pos = get_cluster_offset(new_cluster);
             opt.index = 0;
         }
+        parent_key = parent_fcb.first_cluster;
     }
 
     if (opt.pos < 0) {// 目录项满了
@@ -274,6 +800,9 @@ int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         return -ENFILE;
     }
 
+    // 该名字之前可能被缓存为不存在
+    dcache_remove(parent_key, name);
+
     // 提取文件名
     char *extname;
     char *dot = strrchr(name, '.');
@@ -300,39 +829,96 @@ int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         memcpy(file.extname, extname, strlen(extname));
     file.first_cluster = CLUSTER_END;
 
+    // 先建立句柄，失败时目录中不留下新文件
+    long fcb_offset = opt.pos + opt.index * sizeof(struct FCB);
+    struct FileHandle *fh = file_handle_new(fcb_offset, &file);
+    if (!fh) {
+        free(tmp);
+        return -ENOMEM;
+    }
+
     // 写回
-    if (sizeof(struct FCB) != io_write(&file, opt.pos + opt.index * sizeof(struct FCB), sizeof(struct FCB))) {
+    if (write_fcb(&file, fcb_offset) < 0) {
+        file_handle_free(fh);
+        free(tmp);
         return -EIO;
     }
+    dir_index_add(parent_key, &file, fcb_offset);
 
     free(tmp);
 
+    fi->fh = (uintptr_t)fh;
     return 0;
 }
 
+int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: create创建文件: %s\n", path);
+
+    // 查找空项到写入目录项期间持有父目录的锁
+    struct DirLock lock;
+    journal_begin();
+    dir_lock_parent(path, &lock);
+    int ret = do_create(path, mode, fi);
+    dir_unlock(&lock);
+    journal_end();
+    return commit(NULL, ret);
+}
+
 
 
 int fat16_truncate(const char *path, off_t offset, struct fuse_file_info *fi) {
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: truncate截断: %s\n", path);
 
-    (void) fi;
-
     struct FCB file;
-    long fcb_offset = find_fcb(path, &file);
+    struct OpenFile *opened = NULL;
+    struct FileHandle *fh = get_handle(fi);
+    struct DirLock lock;
+    int locked = 0;
+    int ret;
+
+    journal_begin();
+    if (fh) {
+        opened = fh->file;
+    } else {
+        // 按路径截断时持有父目录的锁，避免 FCB 同时被改名或删除
+        dir_lock_parent(path, &lock);
+        locked = 1;
+
+        long fcb_offset = find_fcb(path, &file);
+        if (fcb_offset < 0) {
+            ret = -ENOENT;
+            goto out;
+        }
 
-    if (fcb_offset < 0)
-       return -ENOENT;
-    
-    if (file.metadata & META_DIRECTORY)
-        return -EISDIR;
+        if (!(opened = open_file_get(fcb_offset))) {
+            ret = file.metadata & META_DIRECTORY ? -EISDIR : _truncate(&file, fcb_offset, NULL, offset);
+            goto out;
+        }
+    }
 
-    return _truncate(&file, fcb_offset, offset);
+    // 文件已打开时修改共享的 FCB，使各句柄看到新的大小与簇链
+    pthread_rwlock_wrlock(&opened->lock);
+    if (opened->fcb.metadata & META_DIRECTORY) {
+        ret = -EISDIR;
+    } else {
+        ret = _truncate(&opened->fcb, opened->fcb_offset, &opened->map, offset);
+        if (ret < 0)
+            open_file_invalidate(opened);
+    }
+    pthread_rwlock_unlock(&opened->lock);
+
+    if (!fh)
+        open_file_put(opened);
+out:
+    if (locked)
+        dir_unlock(&lock);
+    journal_end();
+    return commit(NULL, ret);
 }
 
 
-int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
-    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: rename重命名文件 %s -> %s\n", name, new_name);
-
+// opened 为被移动的文件，仍被打开时由调用者持有其写锁
+static int do_rename(const char *name, const char *new_name, struct OpenFile *opened) {
     struct FCB file;
     struct FCB new_file;
     struct FCB parent_fcb;
@@ -340,13 +926,34 @@ int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
     long offset = find_fcb(name, &file);
     long new_offset = find_fcb(new_name, &new_file);
 
+    if (offset < 0)
+        return (int)offset;
+
+    if (new_offset == offset)   // 仅大小写不同，8.3 名字不变
+        return 0;
+
+    if (opened)
+        memcpy(&file, &opened->fcb, sizeof(struct FCB));
 
     if (new_offset > 0) { // 新目录或文件存在 
         if ((file.metadata & META_DIRECTORY && !is_directory_empty(&new_file))) {   // 非空目录不可覆盖
             return -ENOTEMPTY;
         } else {    // 移动&重命名
-            // 释放将要被覆盖文件的内容
-            release_cluster(new_file.first_cluster);
+            // 释放将要被覆盖文件的内容，仍被打开时推迟到最后一次关闭
+            struct OpenFile *target = open_file_get(new_offset);
+            if (target) {
+                pthread_rwlock_wrlock(&target->lock);
+                open_file_unlink(target);
+                pthread_rwlock_unlock(&target->lock);
+                open_file_put(target);
+            } else {
+                release_cluster(new_file.first_cluster);
+            }
+
+            if (new_file.metadata & META_DIRECTORY) {
+                dcache_purge_dir(new_file.first_cluster);
+                dir_index_drop(new_file.first_cluster);
+            }
 
             char filename[MAX_FILENAME];
             char extname[MAX_EXTNAME];
@@ -360,12 +967,15 @@ int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
             file.filename[0] = '\xe5';
 
             // 写回
-            if (sizeof(struct FCB) != io_write(&new_file, new_offset, sizeof(struct FCB))) {
+            if (write_fcb(&new_file, new_offset) < 0) {
                 return -EIO;
             }
-            if (sizeof(struct FCB) != io_write(&file, offset, sizeof(struct FCB))) {
+            if (write_fcb(&file, offset) < 0) {
                 return -EIO;
             }
+
+            if (opened)
+                open_file_move(opened, new_offset, &new_file);
         }
     } else {    // 目录或文件不存在
         char *tmp = strdup(new_name);
@@ -380,6 +990,7 @@ int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
 
 
         int result;
+        uint16_t parent_key = DCACHE_ROOT;
 
         if (*new_parent == '\0') { // 根目录
             if ((result = traverse_root_dir(&opt, get_free_entry_callback)) < 0) {
@@ -399,14 +1010,15 @@ int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
             }
 
             if (opt.pos < 0) { // 给目录文件扩个容
-                uint16_t new_cluster = file_new_cluster(&parent_fcb, 1);
-                if (sizeof(struct FCB) != io_write(&parent_fcb, parent_offset, sizeof(struct FCB))) {
+                uint16_t new_cluster = file_new_cluster(&parent_fcb, NULL, 1, 1);
+                if (write_fcb(&parent_fcb, parent_offset) < 0) {
                     free(tmp);
                     return -EIO;
                 }
                 opt.pos = get_cluster_offset(new_cluster);
                 opt.index = 0;
             }
+            parent_key = parent_fcb.first_cluster;
         }
 
         if (opt.pos < 0) {// 目录项满了
@@ -414,6 +1026,8 @@ int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
             return -ENFILE;
         }
 
+        dcache_remove(parent_key, new_filename);
+
 
         // 提取文件名
         char *extname;
@@ -443,17 +1057,49 @@ int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
         free(tmp);
 
         // 写回
-        if (sizeof(struct FCB) != io_write(&new_file, opt.pos + opt.index * sizeof(struct FCB), sizeof(struct FCB))) {
+        new_offset = opt.pos + opt.index * sizeof(struct FCB);
+        if (write_fcb(&new_file, new_offset) < 0) {
             return -EIO;
         }
-        if (sizeof(struct FCB) != io_write(&file, offset, sizeof(struct FCB))) {
+        dir_index_add(parent_key, &new_file, new_offset);
+        if (write_fcb(&file, offset) < 0) {
             return -EIO;
         }
+
+        if (opened)
+            open_file_move(opened, new_offset, &new_file);
     }
 
     return 0;
 }
 
+int fat16_rename(const char *name, const char *new_name, unsigned int flags) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: rename重命名文件 %s -> %s\n", name, new_name);
+
+    (void) flags;
+
+    struct DirLock lock;
+    journal_begin();
+    dir_lock_rename(name, new_name, &lock);
+
+    // 被移动的文件仍被打开时持有其写锁，避免写入把 FCB 写回旧的位置
+    struct FCB file;
+    long offset = find_fcb(name, &file);
+    struct OpenFile *opened = offset < 0 ? NULL : open_file_get(offset);
+    if (opened)
+        pthread_rwlock_wrlock(&opened->lock);
+
+    int ret = do_rename(name, new_name, opened);
+
+    if (opened) {
+        pthread_rwlock_unlock(&opened->lock);
+        open_file_put(opened);
+    }
+    dir_unlock(&lock);
+    journal_end();
+    return commit(NULL, ret);
+}
+
 int fat16_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM:chmod: %s\n", path);
 
@@ -474,20 +1120,27 @@ int fat16_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *f
 }
 
 
-int my_statfs(const char *path, struct statvfs *sfs) {
+int fat16_statfs(const char *path, struct statvfs *sfs) {
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM:statfs: %s\n", path);
 
     (void) path;
 
-    // memset(sfs, 0, sizeof(struct statvfs));
-    // sfs->f_bsize = size_cluster;
-    // sfs->f_frsize = sfs->f_bsize;
-    // sfs->f_blocks = size_cluster / sfs->f_bsize;
-    // sfs->f_namemax = MAX_FILENAME;
-    // sfs->f_bfree = (DRIVE_SIZE - HEADER_SECTORS * boot_record.bpb.bytes_per_sector) / sfs->f_bsize;
-    // sfs->f_bavail = sfs->f_bfree;
-    // sfs->f_fsid = 0x1234;
-
+    // 空闲簇数与空闲根目录项数都是增量维护的计数，不必扫描 FAT 表
+    fat_lock_shared();
+    uint32_t free_clusters = alloc_free_count();
+    fat_unlock();
+
+    memset(sfs, 0, sizeof(struct statvfs));
+    sfs->f_bsize = size_cluster;
+    sfs->f_frsize = size_cluster;
+    sfs->f_blocks = alloc_cluster_limit() - CLUSTER_MIN;
+    sfs->f_bfree = free_clusters;
+    sfs->f_bavail = free_clusters;
+    sfs->f_files = boot_record.bpb.root_entries;    // 只有根目录的目录项数是固定的
+    sfs->f_ffree = root_entries_free();
+    sfs->f_favail = sfs->f_ffree;
+    sfs->f_fsid = boot_record.ebpb.volume_serial_number;
+    sfs->f_namemax = MAX_FULLNAME - 1;              // 8.3 文件名，最长 12 个字符
     return 0;
 }
 
@@ -499,9 +1152,7 @@ int fat16_access(const char *path, int flags) {
 }
 
 
-int fat16_unlink(const char *path) {
-    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: unlink删除: %s\n", path);
-
+static int do_unlink(const char *path) {
     struct FCB file;
     long result;
     
@@ -514,16 +1165,53 @@ int fat16_unlink(const char *path) {
     if ((file.metadata & META_DIRECTORY))
         return -EISDIR;
 
-    return remove_file(&file, result);
+    // 仍被打开的文件，簇留给句柄，最后一次关闭时释放
+    struct OpenFile *opened = open_file_get(result);
+    if (opened) {
+        pthread_rwlock_wrlock(&opened->lock);
+        open_file_unlink(opened);
+        pthread_rwlock_unlock(&opened->lock);
+        file.first_cluster = CLUSTER_END;
+    }
+
+    int ret = remove_file(&file, result);
+    open_file_put(opened);
+    return ret;
+}
+
+int fat16_unlink(const char *path) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: unlink删除: %s\n", path);
+
+    struct DirLock lock;
+    journal_begin();
+    dir_lock_parent(path, &lock);
+    int ret = do_unlink(path);
+    dir_unlock(&lock);
+    journal_end();
+    return commit(NULL, ret);
 }
 
 
 int fat16_release(const char *path, struct fuse_file_info *fi) {
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: release释放打开的文件: %s\n", path);
 
-    (void) fi;
+    struct FileHandle *fh = get_handle(fi);
+    journal_begin();
+    if (fh) {
+        pthread_rwlock_wrlock(&fh->file->lock);
+        open_file_sync(fh->file);
+        pthread_rwlock_unlock(&fh->file->lock);
+    }
 
-    return 0;
+    // 最后一次关闭已删除的文件时会释放簇
+    file_handle_free(fh);
+    journal_end();
+    fi->fh = 0;
+
+    if (journal_enabled())
+        return 0;
+
+    return fat_flush();
 }
 
 
@@ -533,11 +1221,7 @@ void fat16_destroy(void *private_data) {
     fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: Image file has been stored! \n");
 }
 
-int fat16_mkdir(const char *path, mode_t mode) {
-    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: mkdir创建目录: %s\n", path);
-
-    (void) mode;
-
+static int do_mkdir(const char *path) {
     if (strcmp(path, "/") == 0)
         return -EINVAL;
 
@@ -560,10 +1244,13 @@ int fat16_mkdir(const char *path, mode_t mode) {
     else
         name = tmp;
 
-    if (!is_filename_available(name)) // 判断目录名是否合法
+    if (!is_filename_available(name)) { // 判断目录名是否合法
+        free(tmp);
         return -EINVAL;
+    }
 
     struct FindOption opt;  // 获取 pos 和 index
+    uint16_t parent_key = DCACHE_ROOT;  // 父目录在目录项缓存中的键
 
     // 查询可用空项
     if (*parent == '\0') {   // rootdir
@@ -584,20 +1271,24 @@ int fat16_mkdir(const char *path, mode_t mode) {
         }
 
         if (opt.pos < 0) { // 给目录文件扩个容
-            uint16_t new_cluster = file_new_cluster(&parent_fcb, 1);
-            if (sizeof(struct FCB) != io_write(&parent_fcb, parent_offset, sizeof(struct FCB))) {
+            uint16_t new_cluster = file_new_cluster(&parent_fcb, NULL, 1, 1);
+            if (write_fcb(&parent_fcb, parent_offset) < 0) {
                 free(tmp);
                 return -EIO;
             }
             opt.pos = get_cluster_offset(new_cluster);
             opt.index = 0;
         }
+        parent_key = parent_fcb.first_cluster;
     }
 
     if (opt.pos < 0) {// 目录项满了
         free(tmp);
         return -ENFILE;
     }
+
+    // 该名字之前可能被缓存为不存在
+    dcache_remove(parent_key, name);
     
     
     // 填充
@@ -609,17 +1300,32 @@ int fat16_mkdir(const char *path, mode_t mode) {
     file.first_cluster = CLUSTER_END;
 
     // 写回
-    if (sizeof(struct FCB) != io_write(&file, opt.pos + opt.index * sizeof(struct FCB), sizeof(struct FCB))) {
+    long fcb_offset = opt.pos + opt.index * sizeof(struct FCB);
+    if (write_fcb(&file, fcb_offset) < 0) {
+        free(tmp);
         return -EIO;
     }
+    dir_index_add(parent_key, &file, fcb_offset);
 
     free(tmp);
     return 0;
 }
 
-int fat16_rmdir(const char *path) {
-    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: rmdir删除目录: %s\n", path);
+int fat16_mkdir(const char *path, mode_t mode) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: mkdir创建目录: %s\n", path);
+
+    (void) mode;
 
+    struct DirLock lock;
+    journal_begin();
+    dir_lock_parent(path, &lock);
+    int ret = do_mkdir(path);
+    dir_unlock(&lock);
+    journal_end();
+    return commit(NULL, ret);
+}
+
+static int do_rmdir(const char *path) {
     struct FCB file;
     long result;
     if((result = find_fcb(path, &file)) < 0) {
@@ -636,5 +1342,24 @@ int fat16_rmdir(const char *path) {
     if (!is_directory_empty(&file))
         return -ENOTEMPTY;
 
+    // 簇可能被新目录重用，其下的缓存项（负项）不再有效
+    if (is_cluster_inuse(file.first_cluster)) {
+        dcache_purge_dir(file.first_cluster);
+        dir_index_drop(file.first_cluster);
+    }
+
     return remove_file(&file, result);
 }
+
+int fat16_rmdir(const char *path) {
+    fuse_log(FUSE_LOG_INFO, "FAT16 SYSTEM: rmdir删除目录: %s\n", path);
+
+    // 删除目录改变了路径与目录的对应关系，并且判空之后不能再有目录项被创建
+    struct DirLock lock;
+    journal_begin();
+    dir_lock_exclusive(&lock);
+    int ret = do_rmdir(path);
+    dir_unlock(&lock);
+    journal_end();
+    return commit(NULL, ret);
+}
@@ -52,7 +52,7 @@ struct FCB {
 
 #define MAX_FILENAME sizeof(((struct FCB *)0)->filename)
 #define MAX_EXTNAME sizeof(((struct FCB *)0)->extname)
-#define MAX_FULLNAME (MAX_FILENAME+MAX_EXTNAME+1)
+#define MAX_FULLNAME (MAX_FILENAME+MAX_EXTNAME+2)   // 文件名 + '.' + 扩展名 + '\0'
 
 // 文件属性
 #define META_READONLY       0b00000001
@@ -98,9 +98,20 @@ void release();
 
     int fat16_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
+    int fat16_read_buf(const char *, struct fuse_bufvec **, size_t, off_t, struct fuse_file_info *);
+
     int fat16_write(const char *, const char *, size_t, off_t, struct fuse_file_info *);
 
     int fat16_flush(const char *, struct fuse_file_info *);
+
+    int fat16_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
+
+    ssize_t fat16_copy_file_range(const char *, struct fuse_file_info *, off_t,
+        const char *, struct fuse_file_info *, off_t, size_t, int);
+
+    int fat16_fsync(const char *, int, struct fuse_file_info *);
+
+    int fat16_fsyncdir(const char *, int, struct fuse_file_info *);
      
     int fat16_rename(const char *name, const char *new_name, unsigned int flags);
 
@@ -118,6 +129,8 @@ void release();
 
     int fat16_access(const char *, int);
 
+    int fat16_statfs(const char *, struct statvfs *);
+
     int fat16_unlink(const char *);
 
     int fat16_release(const char *, struct fuse_file_info *);
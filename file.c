@@ -0,0 +1,262 @@
+#include "file.h"
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define OPEN_FILE_BUCKETS 256
+
+static struct OpenFile *open_files[OPEN_FILE_BUCKETS];
+static struct OpenFile *unlinked;   // 已删除但仍被打开的文件，卸载时释放它们的簇
+// 保护哈希表与引用计数
+// 最后一个引用在表锁内释放预留的簇、写回 FCB，之后才从表中移除，
+// 同时打开同一文件的线程等到 FCB 写回后再从 image 读取
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct OpenFile **bucket(long fcb_offset) {
+    return &open_files[(fcb_offset / sizeof(struct FCB)) % OPEN_FILE_BUCKETS];
+}
+
+static void unhash(struct OpenFile *file) {
+    if (file->fcb_offset < 0)
+        return;
+
+    struct OpenFile **p = bucket(file->fcb_offset);
+    while (*p && *p != file)
+        p = &(*p)->next;
+    if (*p)
+        *p = file->next;
+    file->next = NULL;
+}
+
+static void remove_unlinked(struct OpenFile *file) {
+    struct OpenFile **p = &unlinked;
+    while (*p && *p != file)
+        p = &(*p)->next;
+    if (*p)
+        *p = file->next;
+    file->next = NULL;
+}
+
+static void hash(struct OpenFile *file) {
+    struct OpenFile **p = bucket(file->fcb_offset);
+    file->next = *p;
+    *p = file;
+}
+
+static struct OpenFile *find(long fcb_offset) {
+    if (fcb_offset < 0)
+        return NULL;
+
+    for (struct OpenFile *f = *bucket(fcb_offset); f; f = f->next) {
+        if (f->fcb_offset == fcb_offset)
+            return f;
+    }
+    return NULL;
+}
+
+static void destroy(struct OpenFile *file) {
+    extent_map_free(&file->map);
+    pthread_mutex_destroy(&file->map.lock);
+    pthread_rwlock_destroy(&file->lock);
+    free(file);
+}
+
+// 最后一个引用释放时，释放预留的簇并写回 FCB
+// 簇链长度与文件大小保持一致，image 不会出现多余的簇
+static void finish(struct OpenFile *file) {
+    if (file->preallocated && file->fcb_offset >= 0) {
+        uint16_t first = file->fcb.first_cluster;
+        release_preallocated(&file->fcb, &file->map);
+        if (file->fcb.first_cluster != first)
+            file->dirty = 1;
+        file->preallocated = 0;
+    }
+    open_file_sync(file);
+}
+
+struct OpenFile *open_file_get(long fcb_offset) {
+    pthread_mutex_lock(&table_lock);
+    struct OpenFile *file = find(fcb_offset);
+    if (file)
+        file->refcount++;
+    pthread_mutex_unlock(&table_lock);
+    return file;
+}
+
+void open_file_hold(struct OpenFile *file) {
+    pthread_mutex_lock(&table_lock);
+    file->refcount++;
+    pthread_mutex_unlock(&table_lock);
+}
+
+void open_file_put(struct OpenFile *file) {
+    if (!file)
+        return;
+
+    pthread_mutex_lock(&table_lock);
+    if (--file->refcount > 0) {
+        pthread_mutex_unlock(&table_lock);
+        return;
+    }
+
+    finish(file);
+    if (file->fcb_offset < 0)
+        remove_unlinked(file);
+    else
+        unhash(file);
+    pthread_mutex_unlock(&table_lock);
+
+    // 已删除，释放簇
+    if (file->fcb_offset < 0)
+        release_cluster(file->fcb.first_cluster);
+    destroy(file);
+}
+
+struct FileHandle *file_handle_new(long fcb_offset, const struct FCB *fcb) {
+    struct FileHandle *fh = calloc(1, sizeof(struct FileHandle));
+    if (!fh)
+        return NULL;
+
+    pthread_mutex_lock(&table_lock);
+    struct OpenFile *file = find(fcb_offset);
+    if (!file) {
+        file = calloc(1, sizeof(struct OpenFile));
+        if (!file) {
+            pthread_mutex_unlock(&table_lock);
+            free(fh);
+            return NULL;
+        }
+
+        // 调用者查找 FCB 之后，同一文件的上一次关闭可能刚写回了 FCB（如释放了预留的簇），
+        // 表中没有该文件时 image 中的 FCB 是最新的，仍是同一文件时以它为准
+        struct FCB current;
+        if (cache_read(&current, fcb_offset, sizeof(current)) == sizeof(current)
+            && memcmp(current.filename, fcb->filename, MAX_FILENAME) == 0
+            && memcmp(current.extname, fcb->extname, MAX_EXTNAME) == 0)
+            fcb = &current;
+
+        memcpy(&file->fcb, fcb, sizeof(struct FCB));
+        file->fcb_offset = fcb_offset;
+        extent_map_init(&file->map);
+        pthread_rwlock_init(&file->lock, NULL);
+        hash(file);
+    }
+
+    file->refcount++;
+    pthread_mutex_unlock(&table_lock);
+
+    fh->file = file;
+    readahead_init(&fh->ra);
+    return fh;
+}
+
+void file_handle_free(struct FileHandle *fh) {
+    if (!fh)
+        return;
+
+    struct OpenFile *file = fh->file;
+    readahead_destroy(&fh->ra);
+    if (fh->pinned)
+        unpin_clusters(&file->map);
+    free(fh);
+    open_file_put(file);
+}
+
+void open_file_move(struct OpenFile *file, long new_offset, const struct FCB *fcb) {
+    pthread_mutex_lock(&table_lock);
+    unhash(file);
+    file->fcb_offset = new_offset;
+    memcpy(file->fcb.filename, fcb->filename, MAX_FILENAME);
+    memcpy(file->fcb.extname, fcb->extname, MAX_EXTNAME);
+    hash(file);
+    pthread_mutex_unlock(&table_lock);
+}
+
+void open_file_unlink(struct OpenFile *file) {
+    pthread_mutex_lock(&table_lock);
+    unhash(file);
+    file->fcb_offset = -1;
+    file->next = unlinked;
+    unlinked = file;
+    pthread_mutex_unlock(&table_lock);
+}
+
+void open_file_invalidate(struct OpenFile *file) {
+    pthread_mutex_lock(&file->map.lock);
+    extent_map_invalidate(&file->map);
+    pthread_mutex_unlock(&file->map.lock);
+}
+
+int open_file_sync(struct OpenFile *file) {
+    if (!file->dirty || file->fcb_offset < 0)
+        return 0;
+
+    if (write_fcb(&file->fcb, file->fcb_offset) < 0)
+        return -EIO;
+
+    file->dirty = 0;
+    return 0;
+}
+
+int file_sync_all() {
+    // 先取得所有打开文件的引用，写回时不持有表锁
+    pthread_mutex_lock(&table_lock);
+    size_t count = 0;
+    for (int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        for (struct OpenFile *f = open_files[i]; f; f = f->next)
+            count++;
+    }
+
+    struct OpenFile **files = malloc((count + 1) * sizeof(struct OpenFile *));
+    if (!files) {
+        pthread_mutex_unlock(&table_lock);
+        return -ENOMEM;
+    }
+
+    count = 0;
+    for (int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        for (struct OpenFile *f = open_files[i]; f; f = f->next) {
+            f->refcount++;
+            files[count++] = f;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        pthread_rwlock_wrlock(&files[i]->lock);
+        if (open_file_sync(files[i]) < 0)
+            ret = -EIO;
+        pthread_rwlock_unlock(&files[i]->lock);
+        open_file_put(files[i]);
+    }
+
+    free(files);
+    return ret;
+}
+
+void file_release_all() {
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        struct OpenFile *f = open_files[i];
+        while (f) {
+            struct OpenFile *next = f->next;
+            finish(f);
+            release_cluster(f->map.deferred);
+            destroy(f);
+            f = next;
+        }
+        open_files[i] = NULL;
+    }
+
+    while (unlinked) {
+        struct OpenFile *f = unlinked;
+        unlinked = f->next;
+        release_cluster(f->fcb.first_cluster);
+        release_cluster(f->map.deferred);
+        destroy(f);
+    }
+    pthread_mutex_unlock(&table_lock);
+}
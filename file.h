@@ -0,0 +1,69 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "fat16.h"
+#include "utils.h"
+#include "extent.h"
+#include "readahead.h"
+
+#include <pthread.h>
+
+// 打开的文件，同一文件的多个句柄共享一份
+struct OpenFile {
+    struct FCB fcb;             // 内存中的 FCB
+    long fcb_offset;            // FCB 在 image 的偏移，已删除时为 -1
+    int refcount;               // 引用它的句柄数与临时引用数
+    struct ExtentMap map;       // 文件内偏移到簇的映射
+    int dirty;                  // 内存中的 FCB 已修改，尚未写回 image
+    int preallocated;           // fallocate 在文件大小之后预留了簇，关闭时释放
+    pthread_rwlock_t lock;      // 读文件持有读锁，写入、截断、改名、删除持有写锁
+    struct OpenFile *next;      // 哈希链
+};
+
+// 文件句柄，保存在 fuse_file_info->fh
+struct FileHandle {
+    struct OpenFile *file;
+    struct Readahead ra;        // 顺序读检测与预读窗口
+    int pinned;                 // read_buf 返回过 image 上的段，关闭前截掉的簇推迟释放
+};
+
+// 为 FCB 创建句柄，同一 FCB 的句柄共享 OpenFile
+// 失败返回 NULL
+struct FileHandle *file_handle_new(long fcb_offset, const struct FCB *fcb);
+
+// 关闭句柄，最后一个句柄关闭时释放 OpenFile
+// 若文件已被删除，此时才释放它占有的簇；句柄 pin 过簇时释放推迟的簇
+void file_handle_free(struct FileHandle *fh);
+
+// 根据 FCB 偏移查找已打开的文件并增加引用，未打开返回 NULL
+// 用完后调用 open_file_put
+struct OpenFile *open_file_get(long fcb_offset);
+
+// 为已持有引用的文件增加一个引用
+void open_file_hold(struct OpenFile *file);
+
+// 释放 open_file_get、open_file_hold 取得的引用
+void open_file_put(struct OpenFile *file);
+
+// FCB 被移动到新的位置（重命名），fcb 提供新的文件名
+// 调用者需持有文件的写锁，下同
+void open_file_move(struct OpenFile *file, long new_offset, const struct FCB *fcb);
+
+// 文件被删除，之后不再写回 FCB
+void open_file_unlink(struct OpenFile *file);
+
+// 簇链被截断或替换，使 extent 映射失效
+void open_file_invalidate(struct OpenFile *file);
+
+// 将修改过的 FCB 写回 image
+// 0:成功 负数:失败
+int open_file_sync(struct OpenFile *file);
+
+// 写回所有打开文件修改过的 FCB，会逐个获取文件的写锁
+// 0:成功 负数:失败
+int file_sync_all();
+
+// 释放所有打开的文件，已删除但仍被打开的文件同时释放其簇
+void file_release_all();
+
+#endif
@@ -1,39 +1,233 @@
 #include "io.h"
+#include "uring.h"
+#include "fat16.h"
 
-#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-FILE *image;
+#define IOV_BATCH 64    // 每次 preadv/pwritev 提交的最大 iovec 数
 
+static int image_fd = -1;
+static char *image_map;         // mmap 模式下整个 image 的映射
+static size_t image_size;
+static int use_uring;
+static int unsynced;            // 上次落盘之后写过 image，写入完成后才置位
 
-int init_myio(const char* filename) {
-    if(!(image = fopen(filename, "r+b"))){
+
+int init_myio(const char* filename, int mode) {
+    if((image_fd = open(filename, O_RDWR)) < 0){
         return -1;
     }
 
+    if (mode == IO_MODE_MMAP) {
+        struct stat st;
+        if (fstat(image_fd, &st) < 0 || st.st_size == 0) {
+            io_release();
+            return -1;
+        }
+
+        image_size = st.st_size;
+        image_map = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+        if (image_map == MAP_FAILED) {
+            image_map = NULL;
+            io_release();
+            return -1;
+        }
+    }
+
+    if (mode == IO_MODE_URING) {
+        if (uring_init(image_fd) == 0)
+            use_uring = 1;
+        else
+            fuse_log(FUSE_LOG_WARNING, "io_uring unavailable, falling back to pread/pwrite\n");
+    }
+
     return 0;
 }
 
-size_t io_read(void *buf, long offset, size_t size){
-    if(0 != fseek(image, offset, SEEK_SET)){
+// 映射范围内可以访问的长度
+static size_t map_clamp(long offset, size_t size) {
+    if (offset < 0 || (size_t)offset >= image_size)
         return 0;
+    return size < image_size - offset ? size : image_size - offset;
+}
+
+// pread/pwrite 可能只完成一部分，循环直到完成或出错
+size_t io_read(void *buf, long offset, size_t size){
+    if (image_map) {
+        size = map_clamp(offset, size);
+        memcpy(buf, image_map + offset, size);
+        return size;
     }
-    
-    return fread(buf, 1, size, image);
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(image_fd, (char *)buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    return done;
 }
 
-size_t io_write(void *buf, long offset, size_t size){
-    if(0 != fseek(image, offset, SEEK_SET)){
-        return 0;
+// 写入完成之后调用，之后的 io_sync 才会落盘
+static void mark_unsynced() {
+    __atomic_store_n(&unsynced, 1, __ATOMIC_RELEASE);
+}
+
+size_t io_write(const void *buf, long offset, size_t size){
+    if (image_map) {
+        size = map_clamp(offset, size);
+        memcpy(image_map + offset, buf, size);
+        mark_unsynced();
+        return size;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(image_fd, (const char *)buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    mark_unsynced();
+    return done;
+}
+
+// 提交一组 iovec，部分完成时跳过已完成的部分继续
+static size_t io_vector(int write, const struct iovec *iov, int iovcnt, long offset) {
+    struct iovec vec[IOV_BATCH];
+    size_t total = 0;
+
+    if (image_map) {
+        for (int i = 0; i < iovcnt; i++) {
+            size_t n = write ? io_write(iov[i].iov_base, offset + total, iov[i].iov_len)
+                             : io_read(iov[i].iov_base, offset + total, iov[i].iov_len);
+            total += n;
+            if (n != iov[i].iov_len)
+                break;
+        }
+        return total;
+    }
+
+    while (iovcnt > 0) {
+        int cnt = iovcnt < IOV_BATCH ? iovcnt : IOV_BATCH;
+        memcpy(vec, iov, cnt * sizeof(struct iovec));
+        iov += cnt;
+        iovcnt -= cnt;
+
+        struct iovec *cur = vec;
+        while (cnt > 0) {
+            ssize_t n = write ? pwritev(image_fd, cur, cnt, offset + total)
+                              : preadv(image_fd, cur, cnt, offset + total);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return total;
+
+            total += n;
+            while (cnt > 0 && (size_t)n >= cur->iov_len) {
+                n -= cur->iov_len;
+                cur++;
+                cnt--;
+            }
+            if (cnt > 0) {
+                cur->iov_base = (char *)cur->iov_base + n;
+                cur->iov_len -= n;
+            }
+        }
+    }
+
+    return total;
+}
+
+size_t io_readv(const struct iovec *iov, int iovcnt, long offset) {
+    return io_vector(0, iov, iovcnt, offset);
+}
+
+size_t io_writev(const struct iovec *iov, int iovcnt, long offset) {
+    size_t n = io_vector(1, iov, iovcnt, offset);
+    mark_unsynced();
+    return n;
+}
+
+int io_batch(int write, struct IoRequest *reqs, int count) {
+    for (int i = 0; i < count; i++)
+        reqs[i].done = 0;
+
+    // ring 出错时整批同步重做，返回时内核已不再使用这些缓冲区
+    if (use_uring && uring_submit(write, reqs, count) < 0) {
+        fuse_log(FUSE_LOG_DEBUG, "io_batch: uring submit failed\n");
+        for (int i = 0; i < count; i++)
+            reqs[i].done = 0;
+    }
+
+    if (write)
+        mark_unsynced();
+
+    // 未完成（或部分完成）的请求同步补齐
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        struct IoRequest *r = &reqs[i];
+        if (r->done < r->size) {
+            r->done += write ? io_write((char *)r->buf + r->done, r->offset + r->done, r->size - r->done)
+                             : io_read((char *)r->buf + r->done, r->offset + r->done, r->size - r->done);
+        }
+        if (r->done != r->size)
+            ret = -EIO;
     }
-    
-    size_t ret = fwrite(buf, 1, size, image);
-    fflush(image);
 
     return ret;
 }
 
+int io_fd() {
+    return image_fd;
+}
+
+void io_advise(long offset, size_t size) {
+    posix_fadvise(image_fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+int io_sync(int datasync) {
+    // 上次落盘之后没有写入，不必再等待磁盘；清除标记之后完成的写入会重新置位
+    if (!__atomic_exchange_n(&unsynced, 0, __ATOMIC_ACQ_REL))
+        return 0;
+
+    if ((image_map && msync(image_map, image_size, MS_SYNC) < 0)
+        || (datasync ? fdatasync(image_fd) : fsync(image_fd)) < 0) {
+        int err = errno;
+        mark_unsynced();    // 下次重试
+        return -err;
+    }
+
+    return 0;
+}
+
 void io_release() {
-    if (image) {
-        fclose(image);
+    if (use_uring) {
+        uring_release();
+        use_uring = 0;
+    }
+
+    if (image_map) {
+        msync(image_map, image_size, MS_SYNC);
+        munmap(image_map, image_size);
+        image_map = NULL;
     }
-}
\ No newline at end of file
+
+    if (image_fd >= 0) {
+        fsync(image_fd);
+        close(image_fd);
+        image_fd = -1;
+    }
+}
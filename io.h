@@ -2,10 +2,25 @@
 #define IO_H
 
 #include <stddef.h>
+#include <sys/uio.h>
+
+// image 读写基于 pread/pwrite，不共享文件偏移，可被多个线程同时调用
+
+#define IO_MODE_PREAD   0   // pread/pwrite
+#define IO_MODE_MMAP    1   // 映射整个 image，读写即 memcpy
+#define IO_MODE_URING   2   // 批量读写经 io_uring 一次提交，不支持时退回 pread/pwrite
+
+// 批量读写中的一个请求
+struct IoRequest {
+    void *buf;
+    long offset;
+    size_t size;
+    size_t done;        // 输出，完成的长度
+};
 
 // open image file
 // 0:sucess 负数:fail
-int init_myio(const char* filename);
+int init_myio(const char* filename, int mode);
 
 
 // 保存数据缓冲，读取起点，读取长度
@@ -17,7 +32,45 @@ size_t io_read(void *buf, long offset, size_t size);
  * 数据缓冲，起点，写入长度
  * @return 返回写入长度
  */ 
-size_t io_write(void *buf, long offset, size_t size);
+size_t io_write(const void *buf, long offset, size_t size);
+
+/**
+ * 向量读，将 image 中 offset 开始的连续数据依次读入各个缓冲
+ * @return 返回读取的总长度
+ */
+size_t io_readv(const struct iovec *iov, int iovcnt, long offset);
+
+/**
+ * 向量写，将各个缓冲依次写入 image 中 offset 开始的连续位置
+ * @return 返回写入的总长度
+ */
+size_t io_writev(const struct iovec *iov, int iovcnt, long offset);
+
+/**
+ * 批量读写，互不重叠的多个请求一次提交，全部完成后返回
+ * io_uring 模式下并发执行，其余模式依次执行
+ * @return 0 全部完成，-EIO 有请求未完成
+ */
+int io_batch(int write, struct IoRequest *reqs, int count);
+
+/**
+ * image 的文件描述符，供 splice 等零拷贝传输直接读取
+ * mmap 模式下映射为 MAP_SHARED，经映射写入的数据对文件描述符可见
+ */
+int io_fd();
+
+/**
+ * 提示内核异步把 image 的 [offset, offset + size) 读入页缓存，之后从 io_fd splice 时直接命中
+ */
+void io_advise(long offset, size_t size);
+
+/**
+ * 将已写入的数据落盘，mmap 模式下先执行 msync
+ * 上次落盘之后没有写入 image 时直接返回
+ * @param datasync 为 1 时使用 fdatasync，只保证数据落盘
+ * @return 0 成功，负数失败
+ */
+int io_sync(int datasync);
 
 /**
  * release all resource
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE     // pthread_rwlockattr_setkind_np
+#include "journal.h"
+#include "fat16.h"
+#include "fat.h"
+#include "cache.h"
+#include "file.h"
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4a363146            // "F16J"
+#define JOURNAL_CHECKPOINT (8 << 20)        // 日志超过该大小时将 image 落盘并清空日志
+
+// 事务头，之后是 count 条记录
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t seq;           // 事务序号，重放时必须连续
+    uint64_t length;        // 记录部分的字节数
+    uint64_t checksum;      // 记录部分的 FNV-1a
+};
+
+// 一条记录：image 中 pos 处的 len 字节，内容紧随其后
+struct JournalRecord {
+    uint64_t pos;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+// 正在组装的事务，data 以 JournalHeader 开头
+struct Transaction {
+    char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t count;
+};
+
+static int journal_fd = -1;
+static off_t journal_size;
+static uint64_t next_seq;
+
+// 操作持有读锁，提交时持有写锁取出脏数据；写者优先，避免提交被持续的操作饿死
+static pthread_rwlock_t op_lock;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long op_generation;         // 已完成的操作数
+static unsigned long committed_generation;  // 已提交的操作数，受 commit_lock 保护
+static _Thread_local int depth;             // 当前线程 journal_begin 的嵌套层数
+
+static uint64_t checksum(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 检查记录部分是否完整
+static int validate(const char *data, size_t length, uint32_t count) {
+    size_t off = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct JournalRecord rec;
+        if (length - off < sizeof(rec))
+            return 0;
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec);
+        if (length - off < rec.len)
+            return 0;
+        off += rec.len;
+    }
+    return off == length;
+}
+
+// 将记录写入 image
+static int apply(const char *data, uint32_t count) {
+    int ret = 0;
+    size_t off = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct JournalRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.len != io_write((void *)(data + off), (long)rec.pos, rec.len))
+            ret = -EIO;
+        off += rec.len;
+    }
+    return ret;
+}
+
+static int truncate_journal() {
+    if (ftruncate(journal_fd, 0) < 0 || fsync(journal_fd) < 0)
+        return -errno;
+    journal_size = 0;
+    return 0;
+}
+
+// 重放日志中完整且序号连续的事务，之后清空日志
+static int replay() {
+    off_t end = lseek(journal_fd, 0, SEEK_END);
+    off_t pos = 0;
+    int applied = 0;
+
+    while (end - pos >= (off_t)sizeof(struct JournalHeader)) {
+        struct JournalHeader h;
+        if (pread(journal_fd, &h, sizeof(h), pos) != sizeof(h) || h.magic != JOURNAL_MAGIC)
+            break;
+        if (applied && h.seq != next_seq)   // 上次清空前残留的旧事务
+            break;
+        if (h.length > (uint64_t)(end - pos) - sizeof(h))  // 未写完的事务
+            break;
+
+        char *data = malloc(h.length ? h.length : 1);
+        if (!data)
+            return -ENOMEM;
+
+        if (pread(journal_fd, data, h.length, pos + sizeof(h)) != (ssize_t)h.length ||
+            checksum(data, h.length) != h.checksum || !validate(data, h.length, h.count)) {
+            free(data);
+            break;
+        }
+
+        int ret = apply(data, h.count);
+        free(data);
+        if (ret < 0)
+            return ret;
+
+        next_seq = h.seq + 1;
+        pos += sizeof(h) + h.length;
+        applied++;
+    }
+
+    if (applied) {
+        fuse_log(FUSE_LOG_INFO, "journal: replayed %d transactions\n", applied);
+        int ret = io_sync(0);
+        if (ret < 0)
+            return ret;
+    }
+
+    return truncate_journal();
+}
+
+int journal_open(const char *path) {
+    if ((journal_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -errno;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&op_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    int ret = replay();
+    if (ret < 0) {
+        close(journal_fd);
+        journal_fd = -1;
+        return ret;
+    }
+
+    // 脏块只能经日志写回
+    cache_set_no_steal(1);
+    return 0;
+}
+
+int journal_enabled() {
+    return journal_fd >= 0;
+}
+
+void journal_begin() {
+    if (journal_fd < 0 || depth++ > 0)
+        return;
+
+    pthread_rwlock_rdlock(&op_lock);
+}
+
+void journal_end() {
+    if (journal_fd < 0 || --depth > 0)
+        return;
+
+    __atomic_add_fetch(&op_generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&op_lock);
+
+    // 脏块不能被淘汰，缓存超出预算时提交一次
+    if (cache_over_budget())
+        journal_commit();
+}
+
+static int reserve(struct Transaction *t, size_t len) {
+    if (t->size + len <= t->capacity)
+        return 0;
+
+    size_t capacity = t->capacity ? t->capacity : 64 * 1024;
+    while (capacity < t->size + len)
+        capacity *= 2;
+
+    char *data = realloc(t->data, capacity);
+    if (!data)
+        return -ENOMEM;
+
+    t->data = data;
+    t->capacity = capacity;
+    return 0;
+}
+
+// fat_collect 与 cache_collect 的回调，复制一条记录
+static int emit(void *ctx, long pos, const void *data, size_t len) {
+    struct Transaction *t = ctx;
+    if (reserve(t, sizeof(struct JournalRecord) + len) < 0)
+        return -ENOMEM;
+
+    struct JournalRecord rec = { .pos = pos, .len = len };
+    memcpy(t->data + t->size, &rec, sizeof(rec));
+    memcpy(t->data + t->size + sizeof(rec), data, len);
+    t->size += sizeof(rec) + len;
+    t->count++;
+    return 0;
+}
+
+static int write_journal(const char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(journal_fd, data + done, len - done, journal_size + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        done += n;
+    }
+
+    if (fdatasync(journal_fd) < 0)
+        return -errno;
+
+    journal_size += len;
+    return 0;
+}
+
+int journal_commit() {
+    if (journal_fd < 0 || depth > 0)
+        return 0;
+
+    unsigned long requested = __atomic_load_n(&op_generation, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&commit_lock);
+    if (committed_generation >= requested) {    // 已被其他线程的提交包含
+        pthread_mutex_unlock(&commit_lock);
+        return 0;
+    }
+
+    struct Transaction t = {0};
+    int ret = reserve(&t, sizeof(struct JournalHeader));
+    if (ret < 0) {
+        pthread_mutex_unlock(&commit_lock);
+        return ret;
+    }
+    t.size = sizeof(struct JournalHeader);
+
+    // 等待进行中的操作结束，取出此刻的元数据；取出失败时放弃提交，脏块与脏扇区保持原样
+    pthread_rwlock_wrlock(&op_lock);
+    unsigned long generation = op_generation;
+    file_sync_all();
+    if ((ret = fat_collect(emit, &t)) == 0 && (ret = cache_collect(emit, &t)) < 0)
+        fat_collect_done(0);
+    pthread_rwlock_unlock(&op_lock);
+    if (ret < 0)
+        goto out;
+
+    // 数据不经日志：先把缓存中的数据块写回，连同绕过缓存直接写入的数据一起落盘，
+    // 之后日志中的元数据才能引用它们
+    if ((ret = cache_flush_data()) == 0)
+        ret = io_sync(1);
+
+    if (ret == 0 && t.count > 0) {
+        struct JournalHeader h = {
+            .magic = JOURNAL_MAGIC,
+            .count = t.count,
+            .seq = next_seq,
+            .length = t.size - sizeof(h),
+        };
+        h.checksum = checksum(t.data + sizeof(h), h.length);
+        memcpy(t.data, &h, sizeof(h));
+
+        // 日志落盘之后才能写回 image；写入失败时不写回，序号留给下次提交
+        if ((ret = write_journal(t.data, t.size)) == 0) {
+            next_seq++;
+            ret = apply(t.data + sizeof(h), t.count);
+        }
+    }
+
+    // 未写入日志或未写回 image 的元数据恢复为脏，下次提交重新取出
+    if (ret < 0)
+        fuse_log(FUSE_LOG_ERR, "journal: commit failed: %s\n", strerror(-ret));
+    fat_collect_done(ret == 0);
+    cache_collect_done(ret == 0);
+
+    // 日志过大时，image 落盘后清空日志
+    if (ret == 0 && journal_size > JOURNAL_CHECKPOINT && io_sync(0) == 0)
+        truncate_journal();
+
+    if (ret == 0)
+        committed_generation = generation;
+out:
+    pthread_mutex_unlock(&commit_lock);
+    free(t.data);
+    return ret;
+}
+
+void journal_close() {
+    if (journal_fd < 0)
+        return;
+
+    journal_commit();
+    if (io_sync(0) == 0)
+        truncate_journal();
+
+    close(journal_fd);
+    journal_fd = -1;
+    cache_set_no_steal(0);
+    pthread_rwlock_destroy(&op_lock);
+}
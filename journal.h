@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// 元数据日志，保存在 image 之外的单独文件中
+// 修改元数据的操作在 journal_begin/journal_end 之间进行；
+// 提交时等待进行中的操作结束，把脏的 FAT 扇区和目录块作为一个事务追加到日志并落盘，
+// 之后才写回 image。期间完成的所有操作在一次提交中落盘（组提交）
+// 文件数据不经日志，写入日志之前先写回 image 并落盘，元数据不会引用尚未落盘的数据
+// 挂载时重放日志中完整的事务
+
+// 打开日志文件并重放，需在读入 FAT 表之前调用
+// 0:成功 负数:失败
+int journal_open(const char *path);
+
+// 是否启用了日志
+int journal_enabled();
+
+// 开始、结束一个修改元数据的操作，可以嵌套
+void journal_begin();
+void journal_end();
+
+// 提交所有已完成的操作，不能在 journal_begin/journal_end 之间调用
+// 0:成功 负数:失败
+int journal_commit();
+
+// 提交并将 image 落盘，清空并关闭日志
+void journal_close();
+
+#endif
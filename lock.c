@@ -0,0 +1,99 @@
+#define _GNU_SOURCE     // pthread_rwlockattr_setkind_np
+#include "lock.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+
+#define DIR_LOCK_STRIPES 64
+
+static pthread_mutex_t dir_locks[DIR_LOCK_STRIPES];
+static pthread_rwlock_t ns_lock;
+
+void dir_lock_init() {
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++)
+        pthread_mutex_init(&dir_locks[i], NULL);
+
+    // 写者优先，持续的创建、删除不会让目录改名一直等待；读锁不会重入
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ns_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+// path 的前 len 个字符所指目录的锁号，末尾的 '/' 不参与计算
+// 调用者持有命名空间锁，目录项的偏移在此期间不变
+static int stripe_of(const char *path, size_t len) {
+    while (len > 0 && path[len - 1] == '/')
+        len--;
+    if (len == 0)   // 根目录
+        return 0;
+
+    char *dir = strndup(path, len);
+    if (!dir)
+        return 0;
+
+    struct FCB fcb;
+    long offset = find_fcb(dir, &fcb);
+    free(dir);
+    if (offset < 0)     // 目录不存在，之后的查找同样会失败
+        return 0;
+    return (int)((offset / sizeof(struct FCB)) % DIR_LOCK_STRIPES);
+}
+
+static int stripe_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return stripe_of(path, slash ? (size_t)(slash - path) : 0);
+}
+
+static void lock2(int a, int b) {
+    if (a > b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+
+    pthread_mutex_lock(&dir_locks[a]);
+    if (b != a)
+        pthread_mutex_lock(&dir_locks[b]);
+}
+
+void dir_lock_parent(const char *path, struct DirLock *lock) {
+    pthread_rwlock_rdlock(&ns_lock);
+    lock->exclusive = 0;
+    lock->a = stripe_parent(path);
+    lock->b = -1;
+    pthread_mutex_lock(&dir_locks[lock->a]);
+}
+
+void dir_lock_rename(const char *from, const char *to, struct DirLock *lock) {
+    pthread_rwlock_rdlock(&ns_lock);
+    lock->exclusive = 0;
+    lock->a = stripe_parent(from);
+    lock->b = stripe_parent(to);
+    lock2(lock->a, lock->b);
+
+    // 持有父目录的锁后 from 不会再变化，是目录时改变了路径与目录的对应关系
+    struct FCB fcb;
+    if (find_fcb(from, &fcb) >= 0 && (fcb.metadata & META_DIRECTORY)) {
+        dir_unlock(lock);
+        dir_lock_exclusive(lock);
+    }
+}
+
+void dir_lock_exclusive(struct DirLock *lock) {
+    pthread_rwlock_wrlock(&ns_lock);
+    lock->exclusive = 1;
+    lock->a = -1;
+    lock->b = -1;
+}
+
+void dir_unlock(struct DirLock *lock) {
+    if (lock->a >= 0)
+        pthread_mutex_unlock(&dir_locks[lock->a]);
+    if (lock->b >= 0 && lock->b != lock->a)
+        pthread_mutex_unlock(&dir_locks[lock->b]);
+    pthread_rwlock_unlock(&ns_lock);
+}
@@ -0,0 +1,32 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+// 目录锁
+// 按目录自身的目录项在 image 中的偏移（根目录为 0）散列到固定数量的互斥锁，
+// 在目录中查找空项、写入或删除目录项的操作持有该目录的锁
+// 路径与目录的对应关系只在目录被改名或删除时改变，这两种操作持有命名空间写锁，
+// 其余操作在解析路径、持有目录锁期间持有命名空间读锁，因此同一目录总是对应同一把锁
+// 加锁顺序：命名空间锁 -> 目录锁 -> 文件锁 -> 打开文件表锁 -> FAT 锁与各缓存内部的锁
+
+// 一次加锁取得的锁，由 dir_unlock 释放
+struct DirLock {
+    int exclusive;      // 持有命名空间写锁，此时不再需要目录锁
+    int a;              // 目录锁号，-1 表示未使用
+    int b;
+};
+
+void dir_lock_init();
+
+// 锁住 path 所在的目录（父目录）
+void dir_lock_parent(const char *path, struct DirLock *lock);
+
+// 重命名时同时锁住两个父目录，按锁号顺序加锁避免死锁
+// 被移动的是目录时改为持有命名空间写锁
+void dir_lock_rename(const char *from, const char *to, struct DirLock *lock);
+
+// 持有命名空间写锁，用于删除目录
+void dir_lock_exclusive(struct DirLock *lock);
+
+void dir_unlock(struct DirLock *lock);
+
+#endif
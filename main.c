@@ -9,10 +9,24 @@ static void show_help(const char *progname)
     printf("usage: %s [options] <mountpoint>\n\n", progname);
     printf("FileSystem Options: \n");
     printf("--name filename to store data\n");
+    printf("--mmap map the whole image into memory\n");
+    printf("--uring submit file reads and writes in batches through io_uring\n");
+    printf("--cache=<MiB> buffer cache size, 0 disables it (default 16)\n");
+    printf("--flush_interval=<seconds> write back metadata periodically, 0 disables it (default 5)\n");
+    printf("--durability=<mode> writeback: sync on fsync only (default)\n");
+    printf("                    ordered: also sync on close, data before metadata\n");
+    printf("                    sync: sync after every modifying operation\n");
+    printf("--journal=<file> keep a metadata journal in file, replayed at mount\n");
 }
 
 static const struct fuse_opt options[] = {
         OPTION("--name=%s", filename),
+        OPTION("--mmap", use_mmap),
+        OPTION("--uring", use_uring),
+        OPTION("--cache=%u", cache_size),
+        OPTION("--flush_interval=%u", flush_interval),
+        OPTION("--durability=%s", durability_name),
+        OPTION("--journal=%s", journal),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -25,8 +39,13 @@ static const struct fuse_operations operations = {
 	.opendir = fat16_opendir,
 	.readdir = fat16_readdir,
     .read = fat16_read,
+    .read_buf = fat16_read_buf,
     .write = fat16_write,
     .flush = fat16_flush,
+    .fallocate = fat16_fallocate,
+    .copy_file_range = fat16_copy_file_range,
+    .fsync = fat16_fsync,
+    .fsyncdir = fat16_fsyncdir,
     .rename = fat16_rename,
     .create = fat16_create,
     .mkdir = fat16_mkdir,
@@ -35,6 +54,7 @@ static const struct fuse_operations operations = {
     .chmod = fat16_chmod,
     .chown = fat16_chown,
     .access = fat16_access,
+    .statfs = fat16_statfs,
     .unlink = fat16_unlink,
     .release = fat16_release,
     .destroy = fat16_destroy,
@@ -45,9 +65,17 @@ int main(int argc, char *argv[]){
     int ret;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    g_options.cache_size = 16;
+    g_options.flush_interval = 5;
+
     if (fuse_opt_parse(&args, &g_options, options, NULL) == -1)
         return 1;
 
+    if (parse_durability() < 0) {
+        fprintf(stderr, "unknown durability mode: %s\n", g_options.durability_name);
+        return 1;
+    }
+
     if (g_options.show_help) {
         show_help(argv[0]);
         assert(fuse_opt_add_arg(&args, "--help") == 0);
@@ -1,3 +1,19 @@
 #include "options.h"
 
-struct options g_options;
\ No newline at end of file
+#include <string.h>
+
+struct options g_options;
+
+int parse_durability() {
+    const char *name = g_options.durability_name;
+    if (!name || !strcmp(name, "writeback"))
+        g_options.durability = DURABILITY_WRITEBACK;
+    else if (!strcmp(name, "ordered"))
+        g_options.durability = DURABILITY_ORDERED;
+    else if (!strcmp(name, "sync"))
+        g_options.durability = DURABILITY_SYNC;
+    else
+        return -1;
+
+    return 0;
+}
@@ -1,8 +1,20 @@
 #ifndef OPTIONS_H
 #define OPTIONS_H
 
+// 数据落盘的时机
+#define DURABILITY_WRITEBACK 0  // 只在 fsync 时落盘，close 只写回 image
+#define DURABILITY_ORDERED 1    // close 时也落盘，数据块先于元数据落盘
+#define DURABILITY_SYNC 2       // 每个修改操作完成后立即落盘
+
 struct options{
     const char *filename;
+    int use_mmap;           // --mmap 将 image 映射到内存
+    int use_uring;          // --uring 使用 io_uring 批量提交读写
+    unsigned cache_size;    // --cache 缓冲区缓存大小（MiB）
+    unsigned flush_interval;    // --flush_interval 定时写回元数据的间隔（秒），0 表示不定时写回
+    const char *durability_name;    // --durability=sync|ordered|writeback
+    int durability;             // 解析后的 DURABILITY_*
+    const char *journal;        // --journal 元数据日志文件，未指定时不使用日志
     int show_help;
 };
 
@@ -11,4 +23,8 @@ struct options{
 
 extern struct options g_options;
 
+// 解析 durability_name，未指定时为 writeback
+// 0:成功 负数:名字无效
+int parse_durability();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "readahead.h"
+#include "file.h"
+#include "cache.h"
+#include "journal.h"
+
+#include <stdlib.h>
+
+#define RA_WORKERS 2                // 后台预读线程数
+#define RA_QUEUE 64                 // 等待执行的预读数，满时丢弃新的预读
+#define RA_MIN_CLUSTERS 4           // 初始窗口
+#define RA_MAX_BYTES (4 << 20)      // 窗口上限，同时不超过缓存容量的 1/4
+
+struct Request {
+    struct OpenFile *file;          // 持有引用
+    off_t offset;
+    size_t size;
+};
+
+static struct Request queue[RA_QUEUE];
+static int queue_head;
+static int queue_count;
+static pthread_t workers[RA_WORKERS];
+static int nr_workers;
+static int running;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+// 释放请求持有的引用，最后一个引用可能写回 FCB、释放簇
+static void put_file(struct OpenFile *file) {
+    journal_begin();
+    open_file_put(file);
+    journal_end();
+}
+
+static void *worker_main(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&queue_lock);
+    while (running) {
+        if (queue_count == 0) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+            continue;
+        }
+
+        struct Request req = queue[queue_head];
+        queue_head = (queue_head + 1) % RA_QUEUE;
+        queue_count--;
+        pthread_mutex_unlock(&queue_lock);
+
+        struct OpenFile *file = req.file;
+        pthread_rwlock_rdlock(&file->lock);
+        prefetch_file(&file->fcb, &file->map, req.offset, req.size, 0);
+        pthread_rwlock_unlock(&file->lock);
+        put_file(file);
+
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+// 加入队列，队列已满或未启动时放弃
+static void submit(struct OpenFile *file, off_t offset, size_t size) {
+    pthread_mutex_lock(&queue_lock);
+    if (!running || queue_count == RA_QUEUE) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+
+    open_file_hold(file);
+    queue[(queue_head + queue_count) % RA_QUEUE] = (struct Request){ file, offset, size };
+    queue_count++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void readahead_init(struct Readahead *ra) {
+    pthread_mutex_init(&ra->lock, NULL);
+    ra->next = 0;
+    ra->ahead = 0;
+    ra->window = 0;
+}
+
+void readahead_destroy(struct Readahead *ra) {
+    pthread_mutex_destroy(&ra->lock);
+}
+
+int readahead_start() {
+    if (cache_capacity() == 0)
+        return 0;
+
+    running = 1;
+    for (nr_workers = 0; nr_workers < RA_WORKERS; nr_workers++) {
+        if (pthread_create(&workers[nr_workers], NULL, worker_main, NULL) != 0)
+            break;
+    }
+
+    if (nr_workers == 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void readahead_stop() {
+    pthread_mutex_lock(&queue_lock);
+    running = 0;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < nr_workers; i++)
+        pthread_join(workers[i], NULL);
+    nr_workers = 0;
+
+    while (queue_count > 0) {
+        put_file(queue[queue_head].file);
+        queue_head = (queue_head + 1) % RA_QUEUE;
+        queue_count--;
+    }
+}
+
+// 读完 [offset, offset + size) 之后推进窗口，需要预读时返回预读的长度并由 start 返回起点
+// limit 为窗口上限
+static size_t advance(struct Readahead *ra, off_t offset, size_t size, size_t limit, off_t *start) {
+    pthread_mutex_lock(&ra->lock);
+    off_t end = offset + size;
+    if (offset != ra->next) {   // 随机读，复位
+        ra->next = end;
+        ra->ahead = 0;
+        ra->window = 0;
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+    ra->next = end;
+
+    // 已预读的部分还剩一半以上时不提交
+    if (ra->window > 0 && ra->ahead - end > (off_t)(ra->window / 2)) {
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+
+    size_t window = ra->window ? ra->window * 2 : RA_MIN_CLUSTERS * size_cluster;
+    if (window < size)
+        window = size;
+    ra->window = window < limit ? window : limit;
+
+    size_t len = 0;
+    *start = ra->ahead > end ? ra->ahead : end;
+    off_t until = end + ra->window;
+    if (until > *start) {
+        len = until - *start;
+        ra->ahead = until;
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return len;
+}
+
+void readahead_update(struct Readahead *ra, struct OpenFile *file, off_t offset, size_t size) {
+    size_t limit = cache_capacity() / 4;
+    if (limit > RA_MAX_BYTES)
+        limit = RA_MAX_BYTES;
+    if (!running || limit == 0 || size == 0)
+        return;
+
+    off_t start;
+    size_t len = advance(ra, offset, size, limit, &start);
+    if (len > 0)
+        submit(file, start, len);
+}
+
+void readahead_advise(struct Readahead *ra, struct OpenFile *file, off_t offset, size_t size) {
+    if (size == 0)
+        return;
+
+    off_t start;
+    size_t len = advance(ra, offset, size, RA_MAX_BYTES, &start);
+    if (len == 0)
+        return;
+
+    pthread_rwlock_rdlock(&file->lock);
+    prefetch_file(&file->fcb, &file->map, start, len, 1);
+    pthread_rwlock_unlock(&file->lock);
+}
@@ -0,0 +1,37 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+struct OpenFile;
+
+// 每个句柄的顺序读状态
+// 连续的读被视为顺序读，之后由后台线程异步将后续的簇读入缓冲区缓存，
+// 顺序读持续时预读窗口加倍，直到上限；随机读时复位
+struct Readahead {
+    pthread_mutex_t lock;
+    off_t next;         // 顺序读时下一次读的起点
+    off_t ahead;        // 已提交预读的终点
+    size_t window;      // 预读窗口（字节），0 表示尚未开始预读
+};
+
+void readahead_init(struct Readahead *ra);
+void readahead_destroy(struct Readahead *ra);
+
+// 启动后台预读线程，未启用缓冲区缓存时不预读
+// 0:成功 负数:失败
+int readahead_start();
+
+// 停止后台线程，丢弃尚未执行的预读
+void readahead_stop();
+
+// 读完 [offset, offset + size) 之后调用，需要时提交异步预读
+void readahead_update(struct Readahead *ra, struct OpenFile *file, off_t offset, size_t size);
+
+// read_buf 经 splice 读完 [offset, offset + size) 之后调用，窗口与 readahead_update 相同，
+// 但只提示内核把后续的簇读入 image 的页缓存（posix_fadvise），不占用缓冲区缓存，也不需要后台线程
+// 调用者不能持有文件的锁
+void readahead_advise(struct Readahead *ra, struct OpenFile *file, off_t offset, size_t size);
+
+#endif
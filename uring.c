@@ -0,0 +1,238 @@
+#include "uring.h"
+#include "fat16.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_RINGS 8       // ring 的数量，多个线程可以同时提交
+#define URING_ENTRIES 64    // 每个 ring 的提交队列长度
+#define URING_MAX_ERRORS 16 // 等待完成时连续出错的上限，超过后不再调用 io_uring_enter
+#define URING_POLL_US 1000  // io_uring_enter 不可用时轮询完成队列的间隔
+
+struct Ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    int broken;                 // io_uring_enter 持续失败，ring 不再使用
+    pthread_mutex_t lock;
+};
+
+static struct Ring rings[URING_RINGS];
+static int nr_rings;
+static int target_fd = -1;
+static unsigned next_ring;      // 轮流选择 ring 的起点
+
+static int setup(struct Ring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return -errno;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {    // 两个队列共用一次映射
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto err_fd;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto err_sq;
+    }
+
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err_cq;
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    pthread_mutex_init(&r->lock, NULL);
+    return 0;
+
+err_cq:
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+err_sq:
+    munmap(r->sq_ptr, r->sq_len);
+err_fd:
+    close(r->fd);
+    return -ENOMEM;
+}
+
+static void teardown(struct Ring *r) {
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+}
+
+int uring_init(int fd) {
+    for (nr_rings = 0; nr_rings < URING_RINGS; nr_rings++) {
+        int ret = setup(&rings[nr_rings]);
+        if (ret < 0) {
+            if (nr_rings > 0)   // 至少有一个 ring 即可
+                break;
+            return ret;
+        }
+    }
+
+    target_fd = fd;
+    return 0;
+}
+
+// 取得一个空闲的 ring，都在使用时等待其中一个
+// 所有 ring 都已损坏时返回 NULL
+static struct Ring *acquire() {
+    unsigned start = __atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < nr_rings; i++) {
+        struct Ring *r = &rings[(start + i) % nr_rings];
+        if (pthread_mutex_trylock(&r->lock) == 0) {
+            if (!r->broken)
+                return r;
+            pthread_mutex_unlock(&r->lock);
+        }
+    }
+
+    for (int i = 0; i < nr_rings; i++) {
+        struct Ring *r = &rings[(start + i) % nr_rings];
+        if (__atomic_load_n(&r->broken, __ATOMIC_RELAXED))
+            continue;
+        pthread_mutex_lock(&r->lock);
+        if (!r->broken)
+            return r;
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+// 收取完成事件
+// 返回收到的数量
+static int reap(struct Ring *r, struct IoRequest *reqs) {
+    int n = 0;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        reqs[cqe->user_data].done = cqe->res > 0 ? (size_t)cqe->res : 0;
+        head++;
+        n++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// 提交不超过队列长度的一组请求并等待完成
+static int submit(struct Ring *r, int write, struct IoRequest *reqs, int count) {
+    unsigned tail = *r->sq_tail;
+    for (int i = 0; i < count; i++) {
+        unsigned index = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = target_fd;
+        sqe->addr = (unsigned long)reqs[i].buf;
+        sqe->len = reqs[i].size;
+        sqe->off = reqs[i].offset;
+        sqe->user_data = i;
+        r->sq_array[index] = index;
+        reqs[i].done = 0;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // 请求已交给内核后必须等它们全部完成，缓冲区才能返还调用者
+    int completed = 0;
+    int errors = 0;
+    while (completed < count) {
+        unsigned pending = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            int err = errno;
+            // 没有 SQPOLL，只有 io_uring_enter 会取走请求，出错返回后 sq_head 不再变化
+            unsigned taken = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+            if (taken == tail - count) {
+                // 内核一个也没有取走，撤回后由调用者同步完成
+                __atomic_store_n(r->sq_tail, taken, __ATOMIC_RELEASE);
+                return -err;
+            }
+
+            // 一直无法进入内核时不再提交：撤回内核尚未取走的请求，已取走的请求仍使用
+            // 调用者的缓冲区，轮询完成队列等它们全部完成后才返回；ring 之后不再使用
+            if (++errors >= URING_MAX_ERRORS) {
+                __atomic_store_n(r->sq_tail, taken, __ATOMIC_RELEASE);
+                int submitted = count - (int)(tail - taken);
+                fuse_log(FUSE_LOG_ERR, "io_uring: ring failed, waiting for %d requests\n",
+                         submitted - completed);
+                while ((completed += reap(r, reqs)) < submitted)
+                    usleep(URING_POLL_US);
+                __atomic_store_n(&r->broken, 1, __ATOMIC_RELAXED);
+                return -err;
+            }
+        } else {
+            errors = 0;
+        }
+        completed += reap(r, reqs);
+    }
+
+    return 0;
+}
+
+int uring_submit(int write, struct IoRequest *reqs, int count) {
+    struct Ring *r = acquire();
+    if (!r)
+        return -EIO;
+
+    int ret = 0;
+    for (int i = 0; i < count && ret == 0; i += r->entries) {
+        int n = count - i < (int)r->entries ? count - i : (int)r->entries;
+        ret = submit(r, write, reqs + i, n);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+void uring_release() {
+    for (int i = 0; i < nr_rings; i++)
+        teardown(&rings[i]);
+    nr_rings = 0;
+    target_fd = -1;
+}
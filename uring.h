@@ -0,0 +1,21 @@
+#ifndef URING_H
+#define URING_H
+
+#include "io.h"
+
+// 基于 io_uring 的批量读写，直接使用系统调用，不依赖 liburing
+// 维护一组 ring，每个 ring 同一时刻只被一个线程使用
+
+// 为 fd 建立 ring
+// 0:成功 负数:内核不支持或资源不足，调用者应退回 pread/pwrite
+int uring_init(int fd);
+
+// 一次提交 reqs 中的所有读写并等待全部完成，结果写入各请求的 done
+// 返回时内核不再持有任何请求，出错时也是如此
+// 0:成功提交 负数:ring 出错，调用者应同步重做整批请求
+int uring_submit(int write, struct IoRequest *reqs, int count);
+
+// 释放所有 ring
+void uring_release();
+
+#endif
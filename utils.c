@@ -1,60 +1,147 @@
 #include "utils.h"
 #include "fat16.h"
+#include "fat.h"
+#include "alloc.h"
+#include "extent.h"
+#include "cache.h"
+#include "dcache.h"
+#include "dirindex.h"
+#include "file.h"
+#include "journal.h"
+#include "io.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
+#define TRANSFER_BATCH 32   // 读写文件时一次提交的最大段数
+#define ZERO_CHUNK (1 << 20)    // 清零时每次写入的长度
+
+static uint32_t root_used;      // 根目录中被占用的目录项数
+
+// 全为 0 的缓冲，只作为写入的来源；只读的 bss 页映射到同一个零页，不占用内存
+static char zeros[ZERO_CHUNK];
+
 long find_fcb(const char *path, struct FCB *ret) {
     char *tmp = strdup(path);
     if(!tmp) return -ENOMEM;
 
-    char *name = strtok(tmp, "/");
-    long result = -1;  // 目标fcb在image中的偏移
+    char *save;
+    char *name = strtok_r(tmp, "/", &save);
+    long result = -ENOENT;  // 目标fcb在image中的偏移
 
     int is_root = 1;
-    struct FCB *fcb = NULL; // 存放目标fcb
+    uint16_t parent = DCACHE_ROOT;  // 当前目录在目录项缓存中的键
+    struct FCB fcb;                 // 存放目标fcb
     struct FindOption opt;
 
     // 查询目录
     while(name != NULL) {
-        opt.name = name;
-	    if (is_root) {   // 根目录
-            is_root = 0;
+        if (!is_root && !(fcb.metadata & META_DIRECTORY)) { // 不是目录
+            result = -ENOENT;
+            break;
+        }
 
-            if ((result = traverse_root_dir(&opt, find_file_callback)) < 0) {
-                break;
+        long offset;
+        unsigned long gen = dcache_generation();
+        int hit = dcache_lookup(parent, name, &fcb, &offset);
+        if (hit == 0) {     // 已知不存在
+            result = -ENOENT;
+            break;
+        }
+
+        if (hit < 0) {      // 未缓存，查目录的名字索引
+            hit = dir_index_find(parent, is_root ? NULL : &fcb, name, &opt.fcb, &offset);
+            if (hit == -ENOMEM) {   // 无法建立索引，扫描目录
+                opt.name = name;
+                if (is_root) {   // 根目录
+                    result = traverse_root_dir(&opt, find_file_callback);
+                } else {    // 子目录
+                    result = traverse_sub_dir(&fcb, &opt, find_file_callback);
+                }
+
+                if (result < 0)
+                    break;
+
+                hit = opt.index >= 0;
+                offset = opt.pos + sizeof(struct FCB) * opt.index; // FCB 的偏移
             }
-            
-        } else {    // 子目录
-            if ((result = traverse_sub_dir(fcb, &opt, find_file_callback)) < 0) {
+
+            if (hit < 0) {
+                result = hit;
                 break;
             }
-        }
 
-        if (opt.index < 0)    // 未找到
-            break;
+            if (hit == 0) {   // 未找到
+                dcache_add(parent, name, NULL, -1, gen);
+                result = -ENOENT;
+                break;
+            }
 
-        fcb = &opt.fcb;
-        name = strtok(NULL, "/");
+            memcpy(&fcb, &opt.fcb, sizeof(struct FCB));
+            dcache_add(parent, name, &fcb, offset, gen);
+        }
 
+        result = offset;
+        is_root = 0;
+        parent = fcb.first_cluster;
+        name = strtok_r(NULL, "/", &save);
     }
 
-    if (result >= 0 && opt.index >= 0) { // 完整路径查找到了对应的 FCB
-		result = opt.pos + sizeof(struct FCB) * opt.index; // FCB 的偏移
-	} else {
-		result = -ENOENT;
-	}
-
-    // 查找成功，填充ret
-    if (fcb) {
-        memcpy(ret, fcb, sizeof(*fcb));
+    // 完整路径查找到了对应的 FCB，填充ret
+    if (result >= 0) {
+        memcpy(ret, &fcb, sizeof(struct FCB));
+    } else {
+        result = -ENOENT;
     }
 
     free(tmp);
     return result;
 }
 
+// 目录项是否被文件或目录占用
+static int is_entry_used(const struct FCB *fcb) {
+    return !is_entry_end(fcb) && is_entry_exists(fcb);
+}
+
+int count_root_entries() {
+    struct FCB fcb;
+    uint32_t used = 0;
+    for (long pos = offset_root; pos < offset_data; pos += sizeof(struct FCB)) {
+        if (sizeof(fcb) != cache_read(&fcb, pos, sizeof(fcb)))
+            return -EIO;
+        if (is_entry_end(&fcb))
+            break;
+        used += is_entry_used(&fcb);
+    }
+
+    __atomic_store_n(&root_used, used, __ATOMIC_RELAXED);
+    return 0;
+}
+
+uint32_t root_entries_free() {
+    uint32_t used = __atomic_load_n(&root_used, __ATOMIC_RELAXED);
+    return used < boot_record.bpb.root_entries ? boot_record.bpb.root_entries - used : 0;
+}
+
+int write_fcb(const struct FCB *fcb, long offset) {
+    // 根目录的目录项，维护已占用的数量
+    struct FCB old;
+    int root = offset >= offset_root && offset < offset_data;
+    if (root && sizeof(old) != cache_read(&old, offset, sizeof(old)))
+        return -EIO;
+
+    if (sizeof(struct FCB) != cache_write_meta(fcb, offset, sizeof(struct FCB)))
+        return -EIO;
+
+    if (root && is_entry_used(fcb) != is_entry_used(&old))
+        __atomic_add_fetch(&root_used, is_entry_used(fcb) ? 1 : -1, __ATOMIC_RELAXED);
+
+    dcache_update(offset, fcb);
+    dir_index_update(offset, fcb);
+    return 0;
+}
+
 void get_filename(const struct FCB *fcb, char *filename) {
     //memset(filename, '\0', sizeof(fcb->filename) + 1 + sizeof(fcb->extname) + 1);
     memcpy(filename, fcb->filename, sizeof(fcb->filename));
@@ -82,18 +169,20 @@ void get_filename(const struct FCB *fcb, char *filename) {
     filename[i+1+j]='\x00';
 }
 
-uint16_t next_cluster(uint16_t cluster) {
-    long offset = offset_fat + cluster * sizeof(uint16_t);
-    uint16_t ret = CLUSTER_END;
-
-    if (cluster >= CLUSTER_MIN && 
-        cluster <= CLUSTER_MAX && 
-        cluster < (size_fat/ sizeof(uint16_t)) &&
-        sizeof(ret) != io_read(&ret, offset, sizeof(ret))) {    // 目标项中存有下一簇的簇号
+// 调用者已持有 FAT 锁
+static uint16_t chain_next(uint16_t cluster) {
+    if (cluster < CLUSTER_MIN || cluster > CLUSTER_MAX) {
         return CLUSTER_END;
     }
-    
-    return ret;
+
+    return fat_get(cluster);    // 目标项中存有下一簇的簇号
+}
+
+uint16_t next_cluster(uint16_t cluster) {
+    fat_lock_shared();
+    uint16_t next = chain_next(cluster);
+    fat_unlock();
+    return next;
 }
 
 
@@ -119,14 +208,14 @@ int traverse_root_dir(void *opt,
 
     // 读取root的所有簇
     for(int i = 0; i < number_of_cluster; i++) {
-        if (size_cluster != io_read(dir, pos, size_cluster)){
+        if (size_cluster != cache_read(dir, pos, size_cluster)){
             free(dir);
             return -ENODATA;
         }
                 
         // 遍历簇
         for (int j = 0; j < fcb_per_cluster && j < entries; j++) {
-            if (callback(opt, pos, j, &dir[j]) || dir[i].filename[0] == '\0') {
+            if (callback(opt, pos, j, &dir[j]) || dir[j].filename[0] == '\0') {
 				free(dir);
 				return 0;
 			}
@@ -163,13 +252,14 @@ int traverse_sub_dir(const struct FCB* fcb, void* opt,
 				return -ESPIPE;
 			}
 
-			if (size_cluster != io_read(dir, pos, size_cluster)) {
+			if (size_cluster != cache_read(dir, pos, size_cluster)) {
 				free(dir);
 				return -ENODATA;
 			}
 
 			for (int i = 0; i < fcb_per_cluster; i++) {
 				if (callback(opt, pos, i, &dir[i]) || dir[i].filename[0] == '\0') {
+					free(dir);
 					return 0;
 				}
 			}
@@ -208,6 +298,18 @@ int find_file_callback(void *opt, long pos, int index, const struct FCB* fcb) {
 	return 0;
 }
 
+void fill_stat(const struct FCB *fcb, struct stat *st) {
+	memset(st, 0, sizeof(struct stat));
+	if ((fcb->metadata & META_DIRECTORY)) {  // 子目录
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	} else {    // 普通文件
+		st->st_mode = 0777 | S_IFREG;
+		st->st_nlink = 1;
+		st->st_size = fcb->size;
+	}
+}
+
 int readdir_callback(void* opt, long pos, int index, const struct FCB* fcb) {
 	struct ReadDirOption *rd_opt = opt;
 	if (!fcb)
@@ -222,7 +324,21 @@ int readdir_callback(void* opt, long pos, int index, const struct FCB* fcb) {
 	char fullname[MAX_FULLNAME];
 	get_filename(fcb, fullname);
 
-	rd_opt->filler(rd_opt->buf, fullname, NULL, 0, 0);
+	// 已打开文件内存中的 FCB 可能尚未写回
+	struct stat st;
+	struct OpenFile *opened = open_file_get(pos + index * sizeof(struct FCB));
+	if (opened) {
+		pthread_rwlock_rdlock(&opened->lock);
+		fill_stat(&opened->fcb, &st);
+		pthread_rwlock_unlock(&opened->lock);
+		journal_begin();    // 最后一个引用可能释放预留的簇
+		open_file_put(opened);
+		journal_end();
+	} else {
+		fill_stat(fcb, &st);
+	}
+
+	rd_opt->filler(rd_opt->buf, fullname, &st, 0, rd_opt->flags);
 
 	return 0;
 }
@@ -247,7 +363,90 @@ int get_free_entry_callback(void *opt, long pos, int index, const struct FCB *fc
 }
 
 
-int read_file(const struct FCB *fcb, void *buff, off_t offset, size_t size) {
+// 按 extent 映射在文件与 image 之间传输数据
+// write 为 1 表示写入
+// 查找文件内第 index 簇的簇号，映射失效时先重建
+// run 返回从该簇起物理上连续的簇数
+// 0:成功 负数:失败
+static int map_cluster(struct ExtentMap *map, const struct FCB *fcb, uint32_t index, uint16_t *cluster, uint32_t *run) {
+    int ret = 0;
+    pthread_mutex_lock(&map->lock);
+    if (!map->valid && extent_map_build(map, fcb->first_cluster) < 0) {
+        ret = -ENOMEM;
+    } else {
+        int e = extent_map_find(map, index);
+        if (e < 0) {
+            fuse_log(FUSE_LOG_DEBUG, "cluster index %d out of chain\n", index);
+            ret = -EIO;
+        } else {
+            const struct Extent *ext = &map->extents[e];
+            *cluster = ext->cluster + (index - ext->index);
+            *run = ext->index + ext->length - index;
+        }
+    }
+    pthread_mutex_unlock(&map->lock);
+    return ret;
+}
+
+static int transfer(struct ExtentMap *map, const struct FCB *fcb, const void *buff, off_t offset, size_t size, int write) {
+    struct IoRequest reqs[TRANSFER_BATCH];
+    int count = 0;
+    size_t pos = 0;
+    size_t submitted = 0;
+    while (pos < size) {
+        uint32_t index = (offset + pos) / size_cluster;
+        size_t in_cluster = (offset + pos) % size_cluster;
+
+        // 定位到偏移对应的簇，以及其后连续的簇
+        uint16_t cluster;
+        uint32_t run;
+        int ret = map_cluster(map, fcb, index, &cluster, &run);
+        if (ret < 0)
+            return ret;
+
+        long cluster_offset = get_cluster_offset(cluster);
+        if (cluster_offset < 0) {
+            fuse_log(FUSE_LOG_DEBUG, "invalid cluster %d, cluster_offset < 0 !\n", cluster);
+            return -EIO;
+        }
+
+        // 连续的簇合并为一个请求，大块读写在缓存中直接访问 image
+        size_t n = (size_t)run * size_cluster - in_cluster;
+        if (n > size - pos)
+            n = size - pos;
+
+        // 写入时 buff 只被读取
+        reqs[count++] = (struct IoRequest){ (char *)buff + pos, cluster_offset + in_cluster, n, 0 };
+        pos += n;
+
+        // 各段一起提交，io_uring 模式下并发完成
+        if (count == TRANSFER_BATCH || pos == size) {
+            if (cache_batch(write, reqs, count) < 0) {
+                fuse_log(FUSE_LOG_DEBUG, "Error line: %d, pos=%zu, size=%zu\n", __LINE__, submitted, pos - submitted);
+                return -EIO;
+            }
+            submitted = pos;
+            count = 0;
+        }
+    }
+
+    return pos;
+}
+
+// 将文件 [offset, offset + size) 清零，所在的簇已分配
+static int zero_range(struct ExtentMap *map, const struct FCB *fcb, off_t offset, size_t size) {
+    while (size > 0) {
+        size_t n = size < ZERO_CHUNK ? size : ZERO_CHUNK;
+        int ret = transfer(map, fcb, zeros, offset, n, 1);
+        if (ret < 0)
+            return ret;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int read_file(const struct FCB *fcb, struct ExtentMap *map, void *buff, off_t offset, size_t size) {
     fuse_log(FUSE_LOG_DEBUG, "read_file: file size = %d, offset = %d, size = %d\n", fcb->size, offset, size);
     if (offset >= fcb->size || size == 0) {
         return 0;
@@ -260,59 +459,91 @@ int read_file(const struct FCB *fcb, void *buff, off_t offset, size_t size) {
 
     fuse_log(FUSE_LOG_DEBUG, "size after ajust: %d\n", size);
 
-
-    // 定位到偏移对应的起始簇
-    uint16_t cluster = fcb->first_cluster;
-    while (offset >= size_cluster) {
-        offset -= size_cluster;
-        cluster = next_cluster(cluster);
-        
-        if (cluster < CLUSTER_MIN || cluster > CLUSTER_MAX) {
-            fuse_log(FUSE_LOG_DEBUG, "invalid cluster %d\n", cluster);
-            return -EIO;
-        }
+    // 未打开的文件使用临时映射
+    struct ExtentMap local;
+    if (!map) {
+        extent_map_init(&local);
+        map = &local;
     }
 
-    // 簇是否有效
-    long cluster_offset = get_cluster_offset(cluster);
-    if (cluster_offset < 0) {
-        fuse_log(FUSE_LOG_DEBUG, "cluster_offset < 0 !\n");
-        return -EIO;
-    }
+    int ret = transfer(map, fcb, buff, offset, size, 0);
 
+    if (map == &local)
+        extent_map_free(&local);
+    return ret;
+}
 
-    int pos = 0;
-    int n = size_cluster - offset;
 
-    
-    cluster_offset += offset;
-    while (size > size_cluster) {
-        if (n != io_read(buff + pos, cluster_offset, n))
-            return -EIO;
+void prefetch_file(const struct FCB *fcb, struct ExtentMap *map, off_t offset, size_t size, int page_cache) {
+    if (offset >= fcb->size)
+        return;
+    if (size > fcb->size - offset)
+        size = fcb->size - offset;
+
+    size_t pos = 0;
+    while (pos < size) {
+        uint32_t index = (offset + pos) / size_cluster;
+        size_t in_cluster = (offset + pos) % size_cluster;
 
+        uint16_t cluster;
+        uint32_t run;
+        if (map_cluster(map, fcb, index, &cluster, &run) < 0)
+            return;
+
+        long cluster_offset = get_cluster_offset(cluster);
+        if (cluster_offset < 0)
+            return;
+
+        size_t n = (size_t)run * size_cluster - in_cluster;
+        if (n > size - pos)
+            n = size - pos;
+
+        if (page_cache)
+            io_advise(cluster_offset + in_cluster, n);
+        else
+            cache_prefetch(cluster_offset + in_cluster, n);
         pos += n;
-        n = size_cluster;
-        size -= size_cluster;
+    }
+}
 
-        cluster = next_cluster(cluster);    // 获取下一簇号
-        cluster_offset = get_cluster_offset(cluster);   // 获取簇偏移
-        if (cluster_offset < 0) {
-            fuse_log(FUSE_LOG_DEBUG, "invalid cluster %d, cluster_offset < 0 !\n", cluster);
+int locate_file(const struct FCB *fcb, struct ExtentMap *map, off_t offset, size_t size,
+    struct IoRequest *segs, int max) {
+    if (offset >= fcb->size)
+        return 0;
+    if (size > fcb->size - offset)
+        size = fcb->size - offset;
+
+    int count = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        uint32_t index = (offset + pos) / size_cluster;
+        size_t in_cluster = (offset + pos) % size_cluster;
+
+        uint16_t cluster;
+        uint32_t run;
+        int ret = map_cluster(map, fcb, index, &cluster, &run);
+        if (ret < 0)
+            return ret;
+
+        long cluster_offset = get_cluster_offset(cluster);
+        if (cluster_offset < 0)
             return -EIO;
-        }
-    }
 
-    // 不足一簇
-    if (size != io_read(buff + pos, cluster_offset, size)) 
-        return -EIO;
+        size_t n = (size_t)run * size_cluster - in_cluster;
+        if (n > size - pos)
+            n = size - pos;
 
-    pos += size;
+        if (count == max)
+            return -EINVAL;
+        segs[count++] = (struct IoRequest){ NULL, cluster_offset + in_cluster, n, 0 };
+        pos += n;
+    }
 
-    return pos;
+    return count;
 }
 
 
-int write_file(struct FCB *fcb, long fcb_offset, void *buff, off_t offset, size_t length) {
+int write_file(struct FCB *fcb, long fcb_offset, struct ExtentMap *map, const void *buff, off_t offset, size_t length) {
     fuse_log(FUSE_LOG_DEBUG, "write_file: file size = %d, offset = %d, length = %d\n", fcb->size, offset, length);
 
     if (length == 0)
@@ -321,11 +552,21 @@ int write_file(struct FCB *fcb, long fcb_offset, void *buff, off_t offset, size_
     if (offset + length < offset)  // 溢出了
         return -EINVAL;
 
+    struct ExtentMap local;
+    if (!map) {
+        extent_map_init(&local);
+        map = &local;
+    }
+
+    int ret = -ENOMEM;
+    if (!map->valid && extent_map_build(map, fcb->first_cluster) < 0)
+        goto out;
+
     // 若文件为空，写入数据后占用簇的数量
     uint32_t write_cluster_count = (offset + length + size_cluster - 1) / size_cluster;
 
     // 原有文件大小占用的簇的数量
-    uint32_t now_cluster_count = get_cluster_count(fcb);
+    uint32_t now_cluster_count = map->clusters;
 
     // 若文件为空，写入数据后文件的大小
     uint32_t write_size = offset + length;
@@ -333,69 +574,87 @@ int write_file(struct FCB *fcb, long fcb_offset, void *buff, off_t offset, size_
     // 原有文件大小
     uint32_t now_size = fcb->size;
 
-    // 需要扩容
+    // 需要扩容，新簇中将被写入覆盖的部分不必清零
     if (write_cluster_count > now_cluster_count) {
-        if (CLUSTER_END == file_new_cluster(fcb, write_cluster_count - now_cluster_count))
-            return -ENOSPC;
+        if (CLUSTER_END == file_new_cluster(fcb, map, write_cluster_count - now_cluster_count, 0)) {
+            ret = -ENOSPC;
+            goto out;
+        }
     }
-    
 
     // 文件大小需要更改
     if (write_size > now_size)
         fcb->size = write_size;
 
-    uint16_t cur = fcb->first_cluster;
+    // 文件大小之后的内容无意义，写入起点超出原大小时清零中间的空洞
+    if (offset > now_size && (ret = zero_range(map, fcb, now_size, offset - now_size)) < 0)
+        goto out;
 
-    // 定位到偏移对应的起始簇
-    while (offset >= size_cluster) {
-        //assert(is_cluster_inuse(cur));
-        cur = next_cluster(cur);
-        offset -= size_cluster;
+    if ((ret = transfer(map, fcb, buff, offset, length, 1)) < 0)
+        goto out;
+
+    // fcb_offset < 0 表示文件已被删除，不再写回 FCB
+    if (fcb_offset >= 0 && write_fcb(fcb, fcb_offset) < 0) {
+        ret = -EIO;
     }
 
-    int pos = 0;
-    long cluster_offset = get_cluster_offset(cur);
+out:
+    if (map == &local)
+        extent_map_free(&local);
+    return ret;
+}
 
-    int n = size_cluster - offset;
-    cluster_offset += offset;
-    while (length > size_cluster) {
-        if (n != io_write(buff + pos, cluster_offset, n)) {
-            fuse_log(FUSE_LOG_DEBUG, "Error line: %d, pos=%d, offset=%d, size=%d\n", __LINE__, pos, cluster_offset, n);
-            return -EIO;
-        }
 
-        length -= n;
-        pos +=n;
+// 调用者已持有 FAT 写锁
+static void release_chain(uint16_t first_cluster) {
+    uint16_t next = first_cluster;
+    while (is_cluster_inuse(next)) {
+        uint16_t cur = next;
+        next = chain_next(cur);
+        fat_set(cur, CLUSTER_FREE);
+        alloc_free(cur);
+    }
+}
 
-        cur = next_cluster(cur);
-        cluster_offset = get_cluster_offset(cur);
-        n = size_cluster;
+// 调用者已持有 map->lock 与 FAT 写锁
+// 仍有句柄可能从 image splice 这些簇时，把整条链接到推迟释放的链之前
+static void drop_chain(struct ExtentMap *map, uint16_t first_cluster) {
+    if (!map->pinned || !is_cluster_inuse(first_cluster)) {
+        release_chain(first_cluster);
+        return;
     }
-    
 
-    // 不足一簇
-    if (length != io_write(buff + pos, cluster_offset, length))
-        return -EIO;
+    uint16_t last = first_cluster;
+    while (is_cluster_inuse(chain_next(last)))
+        last = chain_next(last);
+    fat_set(last, is_cluster_inuse(map->deferred) ? map->deferred : CLUSTER_END);
+    map->deferred = first_cluster;
+}
 
-    if (sizeof(struct FCB) != io_write(fcb, fcb_offset, sizeof(struct FCB))) {
-        return -EIO;
+void pin_clusters(struct ExtentMap *map, int *pinned) {
+    pthread_mutex_lock(&map->lock);
+    if (!*pinned) {
+        map->pinned++;
+        *pinned = 1;
     }
-
-    pos += length;
-    return pos;
+    pthread_mutex_unlock(&map->lock);
 }
 
+void unpin_clusters(struct ExtentMap *map) {
+    uint16_t deferred = CLUSTER_FREE;
+    pthread_mutex_lock(&map->lock);
+    if (--map->pinned == 0) {
+        deferred = map->deferred;
+        map->deferred = CLUSTER_FREE;
+    }
+    pthread_mutex_unlock(&map->lock);
+    release_cluster(deferred);
+}
 
 void release_cluster(uint16_t first_cluster) {
-    uint16_t next = first_cluster;
-    while (is_cluster_inuse(next)) {
-        uint16_t buf = CLUSTER_FREE;
-        if (sizeof(uint16_t) != io_write(&buf, offset_fat + next * sizeof(uint16_t), sizeof(uint16_t))) {
-            abort();
-        }
-        
-        next = next_cluster(next);
-    }
+    fat_lock_exclusive();
+    release_chain(first_cluster);
+    fat_unlock();
 }
 
 int is_cluster_inuse(uint16_t cluster_num) {
@@ -406,7 +665,7 @@ int remove_file(struct FCB *file, long offset_fcb) {
     release_cluster(file->first_cluster);
     file->filename[0] = '\xe5';
     // 更新fcb
-    if (sizeof(struct FCB) != io_write(file, offset_fcb, sizeof(struct FCB))) {
+    if (write_fcb(file, offset_fcb) < 0) {
         return -EIO;
     }
     return 0;
@@ -415,10 +674,12 @@ int remove_file(struct FCB *file, long offset_fcb) {
 uint32_t get_cluster_count(struct FCB *fcb) {
     uint32_t count = 0;
     uint16_t cur = fcb->first_cluster;
+    fat_lock_shared();
     while (is_cluster_inuse(cur)) {
         count++;
-        cur = next_cluster(cur);
+        cur = chain_next(cur);
     }
+    fat_unlock();
 
     return count;
 }
@@ -443,149 +704,205 @@ int is_filename_available(const char *filename) {
     return 1;
 }
 
-uint16_t file_new_cluster(struct FCB *file, uint32_t count) {
-    // 分配新的簇，并初始化
-    uint16_t new_cluster = get_free_cluster_num(count);
-    if (new_cluster == CLUSTER_END)  // 没有空间可用了
+// 簇链的最后一簇，空链返回 CLUSTER_END
+// 调用者持有 FAT 锁
+static uint16_t chain_tail(uint16_t first_cluster) {
+    if (!is_cluster_inuse(first_cluster))
         return CLUSTER_END;
 
-    uint16_t cur = new_cluster;
-    char *zero = malloc(size_cluster);
-    if (!zero) {
-        release_cluster(cur);
-        return CLUSTER_END;
-    }
+    uint16_t cur = first_cluster;
+    while (is_cluster_inuse(chain_next(cur)))
+        cur = chain_next(cur);
+    return cur;
+}
 
-    memset(zero, 0, size_cluster);
+uint16_t file_new_cluster(struct FCB *file, struct ExtentMap *map, uint32_t count, int zero) {
+    // 分配新的簇，尽量紧接在文件末尾之后
+    // 文件自身的簇链由调用者持有的文件锁或目录锁保护，期间 tail 不变
+    // 映射有效时由它直接得到最后一簇，不必遍历簇链
+    if (map)
+        pthread_mutex_lock(&map->lock);
+    fat_lock_exclusive();
+    uint16_t tail = map && map->valid ? extent_map_tail(map) : chain_tail(file->first_cluster);
+    uint16_t new_cluster = get_free_cluster_num(count, tail == CLUSTER_END ? CLUSTER_END : tail + 1);
+    fat_unlock();
+    if (map)
+        pthread_mutex_unlock(&map->lock);
+    if (new_cluster == CLUSTER_END)  // 没有空间可用了
+        return CLUSTER_END;
 
-    while (is_cluster_inuse(cur)) {
+    // 新簇还未链接到文件，清零时不必持有 FAT 锁
+    uint16_t cur = new_cluster;
+    while (zero && is_cluster_inuse(cur)) {
         long offset = get_cluster_offset(cur);
-        if (size_cluster != io_write(zero, offset, size_cluster)) {
-            release_cluster(new_cluster);
-            return -EIO;
+        for (size_t done = 0; done < size_cluster; done += ZERO_CHUNK) {
+            size_t n = size_cluster - done < ZERO_CHUNK ? size_cluster - done : ZERO_CHUNK;
+            if (n != cache_write_meta(zeros, offset + done, n)) {
+                release_cluster(new_cluster);
+                return CLUSTER_END;
+            }
         }
         cur = next_cluster(cur);
     }
 
-    if (is_cluster_inuse(file->first_cluster)) {
-        cur = file->first_cluster;
-
-        while (is_cluster_inuse(next_cluster(cur))) {
-            cur = next_cluster(cur);
-        }
-
-        // 写回
-        if (sizeof(uint16_t) != io_write(&new_cluster, offset_fat + cur * sizeof(uint16_t), sizeof(uint16_t))) {
-            release_cluster(new_cluster);
-            return -EIO;
-        }
-        
+    if (map)
+        pthread_mutex_lock(&map->lock);
+    fat_lock_exclusive();
+    if (tail != CLUSTER_END) {
+        fat_set(tail, new_cluster);
     } else {  // 从未分配
         file->first_cluster = new_cluster;
     }
 
+    // 只把新簇追加到映射中
+    if (map && map->valid && extent_map_extend(map, new_cluster) < 0)
+        extent_map_invalidate(map);
+    fat_unlock();
+    if (map)
+        pthread_mutex_unlock(&map->lock);
+
     return new_cluster;
 }
 
-uint16_t get_free_cluster_num(uint32_t count) {
-    if (count == 0)
+uint16_t get_free_cluster_num(uint32_t count, uint16_t goal) {
+    if (count == 0 || count > alloc_free_count())
         return CLUSTER_END;
 
     uint16_t first = CLUSTER_END;
+    uint16_t last = CLUSTER_END;
 
-    while (count--) {
-        size_t i;
-        for (i = 0; i < size_fat / sizeof(uint16_t); i++) {
-            if (next_cluster(i) == CLUSTER_FREE && get_cluster_offset(i) >= 0) {
-                if (sizeof(uint16_t) != io_write(&first, offset_fat + i * sizeof(uint16_t), sizeof(uint16_t))) {
-                    return -EIO;
-                }
-                break;
-            }
-        }
-
-        if (i == size_fat / sizeof(uint16_t)) {
+    while (count > 0) {
+        uint16_t start;
+        uint32_t n = alloc_run(count, goal, &start);
+        if (n == 0) {
             // 不足够分配所需的簇，释放之前分配的簇
-            release_cluster(first);
+            release_chain(first);
             return CLUSTER_END;
         }
-      
-        first = i;  
+
+        // 簇内按顺序链接，再接到上一段之后
+        for (uint32_t i = 0; i + 1 < n; i++) {
+            fat_set(start + i, start + i + 1);
+        }
+        fat_set(start + n - 1, CLUSTER_END);
+
+        if (last == CLUSTER_END)
+            first = start;
+        else
+            fat_set(last, start);
+
+        last = start + n - 1;
+        count -= n;
+        goal = CLUSTER_END;     // 之后的段按最佳适配选择
     }
 
     return first;
 }
 
 
+int _truncate(struct FCB *file, long fcb_offset, struct ExtentMap *map, off_t offset) {
+    // 截断后所需的簇的数量
+    uint32_t new_cluster_count = (offset + size_cluster - 1) / size_cluster;
 
+    uint32_t old_size = file->size;
+    uint32_t new_size = offset;
 
-int _truncate(struct FCB *file, long fcb_offset, off_t offset) {
+    struct ExtentMap local;
+    if (!map) {
+        extent_map_init(&local);
+        map = &local;
+    }
 
+    int ret = -ENOMEM;
+    if (!map->valid && extent_map_build(map, file->first_cluster) < 0)
+        goto out;
 
-    // 文件大小所需的簇的数量
-//    uint32_t old_cluster_count = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if ((ret = adjust_cluster_count(file, map, new_cluster_count)) < 0)
+        goto out;
 
-    // 截断后所需的簇的数量
-    uint32_t new_cluster_count = (offset + size_cluster - 1) / size_cluster;
+    // 文件大小增加时把后面的内容逐段覆盖为 0，内存占用与扩大的长度无关
+    if (old_size < new_size && (ret = zero_range(map, file, old_size, new_size - old_size)) < 0)
+        goto out;
 
-    uint32_t old_size = file->size;
-    uint32_t new_size = offset;
+    ret = 0;
+    if (old_size != new_size) {
+        file->size = new_size;
+        if (fcb_offset >= 0 && write_fcb(file, fcb_offset) < 0)
+            ret = -EIO;
+    }
 
-    int ret;
-    if ((ret = adjust_cluster_count(file, new_cluster_count)) < 0) {
-        return ret;
+out:
+    if (map == &local)
+        extent_map_free(&local);
+    return ret;
+}
+
+int allocate_file(struct FCB *file, long fcb_offset, struct ExtentMap *map, off_t end, int keep_size) {
+    struct ExtentMap local;
+    if (!map) {
+        extent_map_init(&local);
+        map = &local;
     }
 
-    if (old_size == new_size) {
-        return 0;
-    } else if (old_size < new_size) { // 文件大小增加
-        // 把后面的内容覆盖为 0
-        void *null_buf = malloc(new_size - old_size);
-        if (null_buf == NULL)
-            return -EFAULT;
-
-        memset(null_buf, 0, new_size - old_size);
-        int n;
-        if (new_size - old_size != (n = write_file(file, fcb_offset, null_buf, old_size, new_size - old_size))) {
-            free(null_buf);
-            return n;
-        }
-        free(null_buf);
-    } else { // 文件大小减少
-        // 不用管
+    int ret = -ENOMEM;
+    if (!map->valid && extent_map_build(map, file->first_cluster) < 0)
+        goto out;
+
+    // 一次分配所有缺少的簇，分配器会尽量选择一段连续的空闲簇
+    ret = 0;
+    uint32_t need = (end + size_cluster - 1) / size_cluster;
+    if (need > map->clusters && CLUSTER_END == file_new_cluster(file, map, need - map->clusters, 0)) {
+        ret = -ENOSPC;
+        goto out;
     }
 
-    file->size = new_size;
-    return 0;
+    // 改变大小时新的部分必须读出 0，FAT 没有空洞，只能写入
+    if (!keep_size && end > file->size) {
+        if ((ret = zero_range(map, file, file->size, end - file->size)) < 0)
+            goto out;
+        file->size = end;
+        if (fcb_offset >= 0 && write_fcb(file, fcb_offset) < 0)
+            ret = -EIO;
+    }
+
+out:
+    if (map == &local)
+        extent_map_free(&local);
+    return ret;
+}
+
+int release_preallocated(struct FCB *file, struct ExtentMap *map) {
+    if (!map->valid && extent_map_build(map, file->first_cluster) < 0)
+        return -ENOMEM;
+
+    uint32_t need = (file->size + size_cluster - 1) / size_cluster;
+    return map->clusters > need ? adjust_cluster_count(file, map, need) : 0;
 }
 
-int adjust_cluster_count(struct FCB *fcb, uint32_t new_count) {
-    uint32_t old_count = get_cluster_count(fcb);
+int adjust_cluster_count(struct FCB *fcb, struct ExtentMap *map, uint32_t new_count) {
+    uint32_t old_count = map->clusters;
 
     if (old_count == new_count) {
         return 0;
     } else if (old_count > new_count) { // 缩减
-        uint16_t cur = fcb->first_cluster;
-        uint16_t pre = CLUSTER_END;
-        uint32_t counter = new_count;
-        while (counter > 0) {
-            counter--;
-            pre = cur;
-            cur = next_cluster(cur);
-        }
-
-        if (pre == CLUSTER_END) {
+        pthread_mutex_lock(&map->lock);
+        fat_lock_exclusive();
+        if (new_count == 0) {
+            drop_chain(map, fcb->first_cluster);
             fcb->first_cluster = CLUSTER_END;
         } else {
-            uint16_t buf = CLUSTER_FREE;
-            if (sizeof(uint16_t) != io_write(&buf, offset_fat + pre * sizeof(uint16_t) , sizeof(uint16_t))) {
-                return -EIO;
-            }
+            // 由映射直接定位截断后的最后一簇
+            const struct Extent *ext = &map->extents[extent_map_find(map, new_count - 1)];
+            uint16_t last = ext->cluster + (new_count - 1 - ext->index);
+            uint16_t next = chain_next(last);
+            fat_set(last, CLUSTER_END);
+            drop_chain(map, next);
         }
-
-        release_cluster(cur);
-    } else {    // 扩容
-        if (CLUSTER_END == file_new_cluster(fcb, new_count - old_count)) {
+        extent_map_truncate(map, new_count);
+        fat_unlock();
+        pthread_mutex_unlock(&map->lock);
+    } else {    // 扩容，由 _truncate 清零新的部分
+        if (CLUSTER_END == file_new_cluster(fcb, map, new_count - old_count, 0)) {
             return -ENOSPC;
         }
     }
@@ -607,7 +924,7 @@ int is_directory_empty(const struct FCB *file) {
     long offset_cluster;
     while (is_cluster_inuse(cur) && !stop) {
         offset_cluster = get_cluster_offset(cur);
-        if (size_cluster != io_read(dir, offset_cluster, size_cluster)) {
+        if (size_cluster != cache_read(dir, offset_cluster, size_cluster)) {
             free(dir);
             return -EIO;
         }
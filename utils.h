@@ -4,6 +4,8 @@
 #include "fat16.h"
 #include "io.h"
 
+struct ExtentMap;
+
 // 
 struct FindOption {
     // input
@@ -20,6 +22,7 @@ struct ReadDirOption {
 	// 输入
 	fuse_fill_dir_t filler;
 	void *buf;
+	enum fuse_fill_dir_flags flags;    // FUSE_FILL_DIR_PLUS 时属性可直接使用
 };
 
 
@@ -28,12 +31,23 @@ struct ReadDirOption {
 // 返回FCB在image的偏移
 long find_fcb(const char *path, struct FCB *ret);
 
+// 将 FCB 写回 image 的 offset 处，同时更新目录项缓存
+// 0:成功 负数:失败
+int write_fcb(const struct FCB *fcb, long offset);
+
+// 挂载时统计根目录中被占用的目录项，之后由 write_fcb 增量维护
+// 0:成功 负数:失败
+int count_root_entries();
+
+// 根目录中的空闲目录项数
+uint32_t root_entries_free();
+
 // 文件控制块
 // filename返回文件名
 // 返回文件名第一个字节，0表示目录项截至，0xe5表示文件目录项被删除
 void get_filename(const struct FCB *fcb, char *filename);
 
-// 根据fat表找下一个簇的位置
+// 根据fat表找下一个簇的位置，内部持有 FAT 读锁
 // 返回簇号
 uint16_t next_cluster(uint16_t cluster);
 
@@ -54,17 +68,34 @@ int traverse_sub_dir(const struct FCB *fcb, void *opt,
 // 查找文件
 int find_file_callback(void *opt, long pos, int index, const struct FCB *fcb);
 
-// 读目录
+// 根据 FCB 填充文件属性，getattr 与 readdir 共用
+void fill_stat(const struct FCB *fcb, struct stat *st);
+
+// 读目录，同时根据目录项填充属性
 int readdir_callback(void *opt, long pos, int index, const struct FCB *fcb);
 
 // 添加目录表项
 int get_free_entry_callback(void *opt, long pos, int index, const struct FCB *fcb);
 
 // 读文件
-int read_file(const struct FCB *fcb, void *buff, off_t offset, size_t size);
+// map 为文件的 extent 映射，可以为 NULL
+int read_file(const struct FCB *fcb, struct ExtentMap *map, void *buff, off_t offset, size_t size);
+
+// 预读，将文件 [offset, offset + size) 所在的簇读入缓存，超出文件大小的部分忽略
+// page_cache 不为 0 时只提示内核把这些簇读入 image 的页缓存，不经过缓冲区缓存
+// 调用者需持有文件的读锁
+void prefetch_file(const struct FCB *fcb, struct ExtentMap *map, off_t offset, size_t size, int page_cache);
 
-// 写文件
-int write_file(struct FCB *fcb, long fcb_offset, void *buff, off_t offset, size_t size);
+// 将文件 [offset, offset + size) 转换为 image 中物理上连续的段，超出文件大小的部分忽略
+// 各段的 offset、size 为 image 中的位置与长度，buf 不使用
+// 调用者需持有文件的读锁
+// 返回段数，负数为错误，段数超过 max 时返回 -EINVAL
+int locate_file(const struct FCB *fcb, struct ExtentMap *map, off_t offset, size_t size,
+    struct IoRequest *segs, int max);
+
+// 写文件，文件已打开时调用者需持有文件的写锁
+// map 可以为 NULL，扩容后会使其失效；fcb_offset < 0 时不写回 FCB
+int write_file(struct FCB *fcb, long fcb_offset, struct ExtentMap *map, const void *buff, off_t offset, size_t size);
 
 // 释放文件占有的簇
 // 输入文件起始簇号
@@ -83,20 +114,41 @@ uint32_t get_cluster_count(struct FCB *fcb);
 // 判断文件名是否合法
 int is_filename_available(const char *filename);
 
-// 扩容
+// 扩容，zero 为 1 时将新簇清零（目录需要，清零的簇作为元数据块），否则由调用者写入新簇中有效的部分
+// 文件大小之后的内容无意义，扩大文件时需清零原大小与新数据之间的部分
+// map 可以为 NULL；有效时由它得到文件末尾并追加新簇，追加的开销与文件大小无关
 // 返回第一个簇号
-uint16_t file_new_cluster(struct FCB *file, uint32_t count);
+uint16_t file_new_cluster(struct FCB *file, struct ExtentMap *map, uint32_t count, int zero);
 
-// 分配链接好的fat项
+// 分配链接好的fat项，调用者需持有 FAT 写锁
+// goal 为期望的第一个簇号（文件末尾之后），CLUSTER_END 表示没有
 // 返回第一个簇号
-uint16_t get_free_cluster_num(uint32_t count);
+uint16_t get_free_cluster_num(uint32_t count, uint16_t goal);
 
 // 截断
-// 文件扩大或缩小
-int _truncate(struct FCB *, long fcb_offset, off_t offset);
+// 文件扩大或缩小，map 可以为 NULL，截断后仍然有效
+int _truncate(struct FCB *, long fcb_offset, struct ExtentMap *map, off_t offset);
 
-// 
-int adjust_cluster_count(struct FCB *, uint32_t count);
+// 预分配文件 [0, end) 所需的簇，不写入数据
+// keep_size 为 0 时文件大小扩大到 end，新的部分清零；否则文件大小不变，簇预留在文件大小之后
+// map 可以为 NULL，fcb_offset < 0 时不写回 FCB
+// 0:成功 负数:失败
+int allocate_file(struct FCB *, long fcb_offset, struct ExtentMap *map, off_t end, int keep_size);
+
+// 释放文件大小之后预留的簇，map 需随之更新
+// 0:成功 负数:失败
+int release_preallocated(struct FCB *, struct ExtentMap *map);
+
+// 将文件的簇数调整为 count，map 需有效并随之更新
+// map->pinned 不为 0 时截掉的簇不立即释放，留到 unpin_clusters
+int adjust_cluster_count(struct FCB *, struct ExtentMap *map, uint32_t count);
+
+// 句柄开始从 image splice 文件的簇，之后截掉的簇推迟到 unpin_clusters 释放
+// 每个句柄只调用一次，*pinned 记录是否已调用，在 map->lock 内检查
+void pin_clusters(struct ExtentMap *map, int *pinned);
+
+// 句柄关闭时调用，最后一个句柄释放期间推迟的簇
+void unpin_clusters(struct ExtentMap *map);
 
 // 判断目录是否为空
 // 空则返回1